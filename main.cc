@@ -14,8 +14,17 @@
 #include <string.h>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <map>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include <locale.h>
+#include <immintrin.h>
 #include <iostream>
 #include <ctype.h>
 #include "iostream"
@@ -42,6 +51,18 @@ calc_likelihood (IplImage * img, int x, int y)
 	return 1.0 / (sqrt (2.0 * CV_PI) * sigma) * expf (-dist * dist / (2.0 * sigma * sigma));
 }
 
+// the likelihood image is a radius 20 disc blurred with a 27x27 gaussian: beyond
+// this distance from the detection it is black and calc_likelihood is constant
+#define LIKELIHOOD_SUPPORT 36
+
+// calc_likelihood on a black pixel
+float
+likelihood_floor ()
+{
+	float sigma = 50.0;
+	return 1.0 / (sqrt (2.0 * CV_PI) * sigma) * expf (-255.0 * 255.0 / (2.0 * sigma * sigma));
+}
+
 
 
 
@@ -60,12 +81,282 @@ void loadSVMfromModelFile(const char* filename, vector<float>* svm);
 void saveSVMtoFile(const char*filename, vector<float> svm);
 void buildSet(const char* filename, const char* path);
 void evaluateTrainset();
+const char* modeModelFile(bool gray);
 float applyClassifier(vector<float> hog_desc, vector<float> classifier);
 void onMouse( int event, int x, int y, int, void* );
 
+//live capture: decodes on its own thread and keeps only the newest frame,
+//so a tracker slower than the camera drops frames instead of piling up latency
+struct LiveCapture
+{
+	VideoCapture cap;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	Mat newest;				// last decoded frame, not yet handed to the tracker
+	double newestStamp;		// decode time of newest (ms)
+	bool fresh;
+	bool running;
+	long decoded;
+	long dropped;			// frames overwritten before the tracker got them
+};
+bool liveCaptureOpen(LiveCapture &lc, const char* source);
+bool liveCaptureRead(LiveCapture &lc, Mat &frame, double &stamp);
+void liveCaptureClose(LiveCapture &lc);
+bool isLiveSource(const char* source);
+void parseOptions(int &argc, char **argv);
+
+void buildGradientLUT(int nbins);
+
+//hog gradient from lookup tables (8 bit input, no gamma correction). The table
+//is built by the constructor: computeGradient runs on the detectMultiScale
+//workers and only reads it
+class LutHOGDescriptor : public HOGDescriptor
+{
+public:
+	LutHOGDescriptor(Size _winSize, Size _blockSize, Size _blockStride, Size _cellSize, int _nbins,
+					 int _derivAperture, double _winSigma, int _histogramNormType,
+					 double _L2HysThreshold, bool _gammaCorrection)
+	: HOGDescriptor(_winSize, _blockSize, _blockStride, _cellSize, _nbins, _derivAperture,
+					_winSigma, _histogramNormType, _L2HysThreshold, _gammaCorrection)
+	{
+		if(!gammaCorrection && nbins<=255)
+			buildGradientLUT(nbins);
+	}
+	
+	virtual void computeGradient(const Mat& img, Mat& grad, Mat& qangle,
+								 Size paddingTL=Size(), Size paddingBR=Size()) const;
+};
+int verifyLutGradient(const LutHOGDescriptor &hog, const Mat &img);
+
+//integral orientation histogram: cell histograms of any rectangle in O(nbins),
+//used to score arbitrary (non pyramid) windows with the linear svm
+struct IntegralHOG
+{
+	int nbins;
+	int cols, rows;		// size of the source image
+	vector<float> sum;	// (rows+1) x (cols+1) x nbins
+};
+void buildIntegralHOG(const HOGDescriptor &hog, const Mat &img, IntegralHOG &ih);
+float scoreIntegralHOG(const HOGDescriptor &hog, const IntegralHOG &ih, Rect window, const vector<float> &svm);
+bool sparseDetect(const HOGDescriptor &hog, const vector<float> &svm, const Mat &img, Point roiOfs,
+				  Size objSize, vector<Rect> &found);
+
 //hog detector functions
+void hogInput(const Mat &src, Mat &dst);
+int coarseToFineDetect(const HOGDescriptor &hog, const Mat &img, vector<Rect> &found);
+void bgrToGray(const Mat &src, Mat &dst);
 void hogDetect(Mat &img, HOGDescriptor &hog);
-void hogDetectAddSelection(Mat img, HOGDescriptor &hog);
+
+//huge pages for the long lived, reused buffers (level blocks, pooled pyramid
+//levels, particle pool): explicit (MAP_HUGETLB, needs reserved pages) or, if
+//that fails, transparent (madvise). Fewer dTLB misses in the scoring and
+//weighting loops, which sweep several MB per frame
+#define HUGE_PAGE ((size_t)2<<20)
+
+bool hugePages=false;
+size_t hugeExplicitBytes=0, hugeTransparentBytes=0; // currently held
+
+void *hugeAlloc(size_t bytes);
+void hugeFree(void *p, size_t bytes);
+size_t adviseHugePages(void *p, size_t bytes, bool huge);
+
+// growable huge page buffer, never shrinks
+struct HugeBuffer
+{
+	void *p;
+	size_t bytes;
+	HugeBuffer() : p(NULL), bytes(0) {}
+	~HugeBuffer() { if(p) hugeFree(p, bytes); }
+	void reserve(size_t n);
+private:
+	HugeBuffer(const HugeBuffer&);
+	HugeBuffer& operator=(const HugeBuffer&);
+};
+
+// stl allocator: huge pages for buffers of 1 MB and more with --hugepages
+template<class T> struct HugePageAllocator
+{
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+	template<class U> struct rebind { typedef HugePageAllocator<U> other; };
+	
+	HugePageAllocator() {}
+	template<class U> HugePageAllocator(const HugePageAllocator<U>&) {}
+	
+	static bool huge(size_type n) { return hugePages && n*sizeof(T)>=HUGE_PAGE/2; }
+	pointer address(reference r) const { return &r; }
+	const_pointer address(const_reference r) const { return &r; }
+	pointer allocate(size_type n, const void* =0)
+	{
+		if(huge(n))
+			return (pointer)hugeAlloc(n*sizeof(T));
+		return (pointer)::operator new(n*sizeof(T));
+	}
+	void deallocate(pointer p, size_type n)
+	{
+		if(huge(n))
+			hugeFree(p, n*sizeof(T));
+		else
+			::operator delete(p);
+	}
+	size_type max_size() const { return size_t(-1)/sizeof(T); }
+	void construct(pointer p, const T &v) { new(p) T(v); }
+	void destroy(pointer p) { p->~T(); }
+};
+template<class T, class U> bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return true; }
+template<class T, class U> bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return false; }
+
+// data tlb read misses of this thread, -1 if perf events are not available
+int dtlbCounterOpen();
+long long dtlbCounterRead(int fd);
+
+//per pyramid level buffer of normalized block histograms, in hog descriptor order
+//(column major: the blocks of one x position are contiguous, top to bottom)
+struct HogLevelBlocks
+{
+	int nbx, nby;		// blocks of the level
+	int histSize;		// floats per block
+	vector<float> data;	// nbx*nby*histSize, plus padding for the last simd stream
+	const float *blocks;	// &data[0] (the benchmark points it at copies)
+	size_t advised;		// bytes of data advised for transparent huge pages
+	HogLevelBlocks() : blocks(NULL), advised(0) {}
+	~HogLevelBlocks() { hugeTransparentBytes-=advised; }
+private:
+	HogLevelBlocks(const HogLevelBlocks&);
+	HogLevelBlocks& operator=(const HogLevelBlocks&);
+};
+//svm weights reordered and padded to the level buffer layout: one aligned stream per
+//block column of the window, so a window score is wnbx contiguous dot products
+struct CompiledSVM;
+typedef float (*WindowScorer)(const CompiledSVM &cm, const HogLevelBlocks &lb, int bx, int by);
+struct CompiledSVM
+{
+	WindowScorer scorer;	// specialized for the window geometry if there is one
+	bool specialized;
+	int wnbx, wnby;		// blocks of the window
+	int histSize;
+	int colLen;			// floats per column stream (wnby*histSize padded to 16)
+	float bias;
+	vector<float> storage;
+	size_t alignOfs;
+	const float* weights() const { return &storage[alignOfs]; }
+	
+	CompiledSVM() : scorer(0), specialized(false), wnbx(0), wnby(0), histSize(0), colLen(0), bias(0.f), alignOfs(0) {}
+	CompiledSVM(const CompiledSVM &o) { *this=o; }
+	CompiledSVM& operator=(const CompiledSVM &o);
+};
+void computeLevelBlocks(const HOGDescriptor &hog, const Mat &img, HogLevelBlocks &lb);
+void compileSVMModel(const HOGDescriptor &hog, const vector<float> &model, CompiledSVM &cm);
+WindowScorer selectWindowScorer(int wnbx, int wnby, int histSize, int nbins);
+float scoreCompiled(const CompiledSVM &cm, const HogLevelBlocks &lb, int bx, int by);
+float scoreFlat(const HOGDescriptor &hog, const vector<float> &model, const HogLevelBlocks &lb, int bx, int by);
+void compiledDetectMultiScale(const HOGDescriptor &hog, const CompiledSVM &cm, const Mat &img, vector<Rect> &found);
+void multiShapeDetectMultiScale(const HOGDescriptor &hog, const vector<const CompiledSVM*> &models,
+								const vector<Size> &sizes, const Mat &img, vector<Rect> &found, vector<int> &shapeOf);
+
+//a window shape besides the main one; same blocks, cells and bins, own model
+struct HogShape
+{
+	Size winSize;
+	vector<float> model;
+	CompiledSVM compiled;
+};
+
+//pluggable object detector: hog+svm or aggregate channel features (acf)
+class ObjectDetector
+{
+public:
+	unsigned modelVersion;	// bumped on every model change, keys the detection cache
+	
+	ObjectDetector() : modelVersion(0) {}
+	virtual ~ObjectDetector() {}
+	// finds objects in img, the search roi at roiOfs in the frame. objSize is the size
+	// of the tracked object, empty when nothing is tracked. Rects in img coordinates
+	virtual void detect(const Mat &img, Point roiOfs, Size objSize, vector<Rect> &found) = 0;
+	// learns a new model from the sample store (Trainpath pos.lst and neg.lst)
+	virtual void retrain() = 0;
+	virtual const char* name() const = 0;
+};
+
+class HogSvmDetector : public ObjectDetector
+{
+public:
+	LutHOGDescriptor hog;
+	vector<float> model;
+	CompiledSVM compiled;	// model in level buffer layout, rebuilt by setModel
+	vector<HogShape> shapes;	// extra window shapes, scored on the same level buffers
+	
+	HogSvmDetector(Size win);
+	void setModel(const vector<float> &m);
+	bool addShape(Size win, const char* modelFile);
+	virtual void detect(const Mat &img, Point roiOfs, Size objSize, vector<Rect> &found);
+	virtual void retrain();
+	virtual const char* name() const { return "hog+svm"; }
+};
+
+// depth two tree: node 0 splits to node 1 (below thr) or 2, those split to the leaves
+struct AcfTree
+{
+	int fid[3];
+	float thr[3];
+	float leaf[4];
+};
+
+class AcfDetector : public ObjectDetector
+{
+public:
+	Size winSize;
+	int shrink;				// channel aggregation block (pixels)
+	int nWeak;				// trees trained by retrain()
+	float cascadeThreshold;	// soft cascade: stop a window when its score drops below
+	float hitThreshold;
+	vector<AcfTree> trees;
+	
+	AcfDetector(Size win);
+	bool load(const char* filename);
+	bool save(const char* filename) const;
+	virtual void detect(const Mat &img, Point roiOfs, Size objSize, vector<Rect> &found);
+	virtual void retrain();
+	virtual const char* name() const { return "acf"; }
+	
+private:
+	void scanLevel(const Mat &chans, double scale, vector<Rect> &found) const;
+};
+
+void detectAddSelection(Mat img, ObjectDetector &detector);
+
+//results of the last few detections, keyed on what determines them; repeated
+//frames (stalled encoders, low fps sources re-emitted) skip detection
+struct DetectionCacheEntry
+{
+	unsigned long long fingerprint;
+	Rect roi;
+	vector<Rect> modeRois;	// mode boxes scanned inside roi, empty for the whole roi
+	Size objSize;
+	unsigned modelVersion;
+	bool gray;
+	vector<Rect> found;
+};
+
+struct DetectionCache
+{
+	vector<DetectionCacheEntry> entries;	// most recent last
+	size_t capacity;
+	long hits, misses;
+	
+	DetectionCache() : capacity(4), hits(0), misses(0) {}
+};
+
+unsigned long long frameFingerprint(const Mat &img);
+bool detectionCacheLookup(DetectionCache &dc, const DetectionCacheEntry &key, vector<Rect> &found);
+void detectionCacheStore(DetectionCache &dc, const DetectionCacheEntry &key, const vector<Rect> &found);
+void benchmarkModelScoring(HogSvmDetector &hd, const Mat &img, FILE* out);
 void loadSVMfromFile(const char*filename, vector<float>* svm);
 
 //adaptive hog variables
@@ -75,6 +366,27 @@ Point origin;
 Rect selection;
 int skipAddSamples=4;
 int skipOldSamples=10;
+bool grayDetection=false; // run hog on luminance only (train and detect)
+bool evalTrainset=false; // training also runs evaluateTrainset (hard negatives, color vs gray)
+bool lutGradient=false; // table driven gradients, needs hog without gamma correction
+bool sparseScoring=false; // while tracking, score particle hypotheses on an integral histogram
+float sparseHitThreshold=0.0; // svm threshold for the approximate integral hog score
+bool coarseToFine=false; // stride 16 scan, stride 8 only around near-positive windows
+double coarseRelaxation=0.5; // the coarse pass keeps windows scoring above -coarseRelaxation
+bool compiledScoring=false; // own pyramid scan over level block buffers with the compiled model
+vector<string> shapeSpecs; // extra window shapes "WxH:modelfile"
+bool dupCache=false; // reuse detections when the search roi repeats a recent frame
+bool regularizedPF=false; // resample from a gaussian kernel estimate instead of duplicating particles
+
+// half widths of the uniform process noise of the condensation filter (px and
+// px/frame); the regularized filter gets its spread from the kernel jitter
+inline float pfPosNoise() { return regularizedPF ? 8.f : 25.f; }
+inline float pfVelNoise() { return regularizedPF ? 2.f : 5.f; }
+bool raoBlackwellized=false; // sample positions only, velocity kept as a gaussian per particle
+bool meanShiftEstimate=false; // report the main mode of the weighted particles, not their mean
+bool gridCulling=false; // evaluate the likelihood only for particles in grid cells near the detection
+int fastExpDegree=0; // >0: sse likelihood kernels with an exp polynomial of this degree (3..6), 0: libm
+bool mathCheck=false; // --mathcheck: validate the fast math kernels at startup, exit 1 above the bounds
 
 // pf vars
 int n_stat = 4;
@@ -89,11 +401,304 @@ int minParticles=100;
 //double Neff_norm;
 float Neff=0.0;
 
+enum { POOL_X, POOL_Y, POOL_VX, POOL_VY, POOL_W, POOL_FIELDS };
+
+//preallocated particle storage shared by all filters: two banks of capacity
+//particles (x, y, vx, vy, w arrays), each filter owns a contiguous range of the
+//current bank. Resampling writes the filter's new range of the other bank.
+//Compact pools keep x, y, vx, vy as float16 (positions relative to the origin
+//of their track) and only the weights as float
+struct ParticlePool
+{
+	int capacity;
+	int bank;
+	bool compact;
+	vector<float, HugePageAllocator<float> > data[2];
+	vector<unsigned short, HugePageAllocator<unsigned short> > half[2];
+	
+	float* field(int b, int f) { return &data[b][(compact ? f-POOL_W : f)*capacity]; }
+	unsigned short* halfField(int b, int f) { return &half[b][f*capacity]; }
+};
+
+// Rao-Blackwellized filter: position samples, velocity marginalized with a
+// kalman filter per particle. All particles see the same dt and the same
+// linear model, so the velocity variance P is the same for all of them
+struct RBFilter
+{
+	int n;
+	int ofs;			// first particle in the pool bank
+	float *x, *y;		// position samples, in the particle pool (NULL if compact)
+	float *vx, *vy;		// velocity mean of each particle
+	float *w;			// normalized weights
+	unsigned short *hx, *hy, *hvx, *hvy;	// compact pool: float16 of the above
+	float ox, oy;		// compact pool: origin of the float16 positions
+	float P;			// velocity variance per axis
+	float q;			// velocity process noise variance per frame
+	float sigmaPos;		// position noise std per frame
+	int missed;			// frames since the last detection
+	RNG rng;
+};
+RBFilter rbpf;
+ParticlePool particlePool;
+int particleBudget=0; // >0: particles of all filters, shared by uncertainty every frame
+bool compactParticles=false; // float16 particle storage in the pool
+
+void poolInit(ParticlePool &pool, int capacity, bool compact);
+float rbX(const RBFilter &f, int k);
+float rbY(const RBFilter &f, int k);
+float rbVX(const RBFilter &f, int k);
+float rbVY(const RBFilter &f, int k);
+void rbInit(RBFilter &f, ParticlePool &pool, int ofs, int n, Size area);
+void rbPredict(RBFilter &f, double dt);
+void rbEstimate(const RBFilter &f, float* state);
+void rbResample(RBFilter &f, ParticlePool &pool, int ofs, int n);
+float rbUncertainty(const RBFilter &f);
+void scheduleParticles(ParticlePool &pool, vector<RBFilter*> &filters, int budget);
+
+//the filters of the pool run as one batch: long passes over the current bank,
+//track t owning particles [seg[t], seg[t+1])
+struct FilterBatch
+{
+	vector<int> seg;
+	vector<float> noise;	// standard normals for the prediction, 2 per particle
+	vector<float> gain, sd;	// per particle copies of the track constants
+	vector<float> lik;
+	vector<float> px, py;	// decoded positions of a compact pool
+	RNG rng;
+};
+bool batchedFilters=false; // predict/weight/normalize all tracks in single passes
+
+void batchPredict(FilterBatch &b, ParticlePool &pool, vector<RBFilter*> &filters, double dt);
+bool cpuHasF16C();
+float halfToFloat(unsigned short h);
+unsigned short floatToHalf(float f);
+void decodeHalf(const unsigned short* h, int n, float origin, float* out);
+void predictHalf(unsigned short *x, unsigned short *y, unsigned short *vx, unsigned short *vy,
+				 const float *ex, const float *ey, const float *sd, const float *gain, float dt, int from, int n);
+void predictHalfF16C(unsigned short *x, unsigned short *y, unsigned short *vx, unsigned short *vy,
+					 const float *ex, const float *ey, const float *sd, const float *gain, float dt, int n);
+void batchWeight(FilterBatch &b, ParticlePool &pool, vector<RBFilter*> &filters, IplImage *img,
+				 const vector<float> *precomputed, vector<float> &neff);
+int particleCount();
+Point2f particlePosition(int i);
+float particleWeight(int i);
+
+//particles bucketed by position (counting sort), cell c holds
+//index[start[c]..start[c+1])
+struct ParticleGrid
+{
+	int cell;
+	int cols, rows;
+	vector<int> start;
+	vector<int> index;
+};
+
+void buildParticleGrid(ParticleGrid &g, Size area, int cell);
+long gridLikelihood(const ParticleGrid &g, IplImage *img, Point center, vector<float> &lik);
+void particleLikelihoods(IplImage *img, vector<float> &lik);
+void likelihoodKernel(IplImage *img, const float *x, const float *y, int n, float *lik);
+bool validateFastMath();
+Point2f meanShiftMode(Point2f start, float bandwidth, int maxIter);
+
+//gaussian summary of the filtered posterior of a frame, for offline smoothing
+struct FrameSummary
+{
+	int frame;
+	double dt;		// frame time of the prediction into this frame
+	bool detected;
+	double m[4];	// x, y, vx, vy
+	double P[16];
+};
+
+int offlineDetectEvery=0; // >0: offline run, detector every this many frames while tracking
+
+//amortized reacquisition: the frame split in K overlapping vertical slices,
+//one scanned per frame, nearest to the last known position first
+struct ReacquireScan
+{
+	vector<Rect> slices;
+	vector<int> order;	// slice indices by distance from anchor, rebuilt every round
+	int next;			// position in order
+	Point anchor;		// last known position of the target
+	Size area, objSize;
+	
+	ReacquireScan() : next(0) {}
+};
+
+int reacquireSlices=0; // >0: a lost target is searched one of this many slices per frame
+
+//a mode of the particle cloud: weighted centre, spread (std dev) and share of the weight
+struct ParticleMode
+{
+	Point2f center;
+	Point2f spread;
+	float mass;
+};
+
+int multiModes=0; // >0: estimate from the heaviest of this many modes, search roi around each
+
+int extractModes(float cell, int maxModes, bool weighted, vector<ParticleMode> &modes);
+
+//per frame memory: a bump arena for the temporaries of one frame (reset at the
+//top of the loop, so steady state is one block and no malloc) and a pool of
+//size classes for frame sized Mats and pyramid levels
+struct FrameArena
+{
+	vector<char*> blocks;
+	vector<size_t> sizes;
+	size_t used;	// bytes used in the last block
+	size_t frameBytes, peak;
+	FrameArena() : used(0), frameBytes(0), peak(0) {}
+};
+
+FrameArena *frameArena=0; // non null with --arena
+
+void *arenaAlloc(FrameArena &a, size_t bytes);
+void arenaReset(FrameArena &a);
+
+// stl allocator on the frame arena (plain new/delete without --arena). Freeing
+// is a no-op: containers using it must not outlive the frame
+template<class T> struct ArenaAllocator
+{
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+	template<class U> struct rebind { typedef ArenaAllocator<U> other; };
+	
+	FrameArena *arena;
+	ArenaAllocator() : arena(frameArena) {}
+	template<class U> ArenaAllocator(const ArenaAllocator<U> &o) : arena(o.arena) {}
+	
+	pointer address(reference r) const { return &r; }
+	const_pointer address(const_reference r) const { return &r; }
+	pointer allocate(size_type n, const void* =0)
+	{
+		if(!arena)
+			return (pointer)::operator new(n*sizeof(T));
+		return (pointer)arenaAlloc(*arena, n*sizeof(T));
+	}
+	void deallocate(pointer p, size_type)
+	{
+		if(!arena)
+			::operator delete(p);
+	}
+	size_type max_size() const { return size_t(-1)/sizeof(T); }
+	void construct(pointer p, const T &v) { new(p) T(v); }
+	void destroy(pointer p) { p->~T(); }
+};
+template<class T, class U> bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.arena==b.arena; }
+template<class T, class U> bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.arena!=b.arena; }
+
+template<class T> struct FrameVector { typedef vector<T, ArenaAllocator<T> > type; };
+
+#define MATPOOL_CLASSES 24	// 4 KiB << 0..23
+#define MATPOOL_HEADER 64	// refcount and size class in front of the data, keeps the alignment
+
+// released buffers go to a free list of their power of two class instead of back
+// to malloc. Only the tracking thread allocates from it, so there is no lock
+class PoolMatAllocator : public MatAllocator
+{
+public:
+	PoolMatAllocator() : hits(0), misses(0), bytes(0) {}
+	~PoolMatAllocator();
+	void allocate(int dims, const int* sizes, int type, int*& refcount,
+				  uchar*& datastart, uchar*& data, size_t* step);
+	void deallocate(int* refcount, uchar* datastart, uchar* data);
+	long hits, misses;
+	size_t bytes;	// held by the pool, in use or free
+private:
+	vector<uchar*> freeBlocks[MATPOOL_CLASSES];
+};
+
+PoolMatAllocator *matPool=0; // non null with --arena
+
+// buffers of m come from the pool from now on (if enabled)
+inline void framePooled(Mat &m)
+{
+	if(matPool)
+		m.allocator=matPool;
+}
+
+void reportFrameMemory();
+
+//numa placement: the tracking thread (and every thread it starts afterwards:
+//live capture, opencv workers) runs on the cpus of one node, so buffers are
+//first touched, hence placed, there
+struct NumaStat
+{
+	long numaHit, numaMiss, otherNode; // node counters, all processes
+};
+
+int numaNode=-1; // >=0: run on this node
+
+int numaNodeCount();
+bool numaPin(int node);
+bool numaReadStat(int node, NumaStat &st);
+void numaProcessPages(vector<long> &kbPerNode);
+void reportNuma(const NumaStat &start);
+
+void reacquireInit(ReacquireScan &rs, Size area, Size objSize, int k);
+void reacquireRestart(ReacquireScan &rs, Point anchor);
+Rect reacquireNext(ReacquireScan &rs);
+
+//track state machine: what the target is believed to be doing decides how much
+//detector effort the next frame gets
+enum TrackState { TRACK_TRACKING, TRACK_OCCLUDED, TRACK_LOST, TRACK_DEAD };
+
+struct TrackMachine
+{
+	TrackState state;
+	int stateFrames;	// frames spent in the current state
+	int misses;			// detector runs without a detection since the last one
+	ReacquireScan scan;	// lost: slices of the rotating scan
+	int occludeMisses;	// tracking: misses before coasting (healthy N_eff)
+	int lostMisses;		// misses (tracking misses plus failed probes) before the target counts as lost
+	int maxOccluded;	// occluded: coasting frames cap, for when no probe can run
+	int probeEvery;		// occluded: detector on the predicted roi every this many frames
+	int lostFrames;		// frames of rotating scan before the target counts as dead
+	int slices;			// slices of the rotating scan
+	int deadPeriod;		// dead: full scan every this many frames
+	float minNeff;		// normalized N_eff a filter needs to coast through a miss
+	
+	TrackMachine() : state(TRACK_LOST), stateFrames(0), misses(0), occludeMisses(2), lostMisses(5), maxOccluded(30),
+					 probeEvery(3), lostFrames(60), slices(4), deadPeriod(10), minNeff(0.05f) {}
+};
+
+bool trackStates=false; // tracking/occluded/lost/dead effort policy instead of roi or full frame
+
+const char* trackStateName(TrackState s);
+void trackUpdate(TrackMachine &tm, bool attempted, bool detected, float neff);
+bool trackPlan(TrackMachine &tm, Point estimate, Size objSize, Size area, Rect &roi);
+
+void summarizeFilter(FrameSummary &fs, bool weighted);
+void smoothTrack(vector<FrameSummary> &track);
+void writeSmoothedTrack(const vector<FrameSummary> &track, const char* filename);
+Point2f particleVelocity(int i);
+
+// filter evaluation: estimate vs detection error and likelihood weighting cost
+double pfErrorSum=0.0;
+int pfErrorFrames=0;
+double weightTimeSum=0.0;
+int weightFrames=0;
+
+bool kernelBandwidth(const CvConDensation *cd, float* L);
+void jitterParticles(CvConDensation *cd, const float* L, RNG &rng);
+void reportFilterAccuracy();
+
 // main vars
 int frameNumber=0;
 Size frameSize;
 double t; // detection time
 
+// live source vars
+bool liveMode=false;
+double framePeriod=40.0; // nominal inter-frame time (ms) the motion model is tuned for
+#define MAX_FRAME_DT 4.0	// longer gaps (pause, stall) are not extrapolated with the velocity
+
 
 
 
@@ -152,7 +757,24 @@ int main(int argc,char **argv )
 	
 	if (argc==1 || strcmp(argv[1],"--help")==0)
 	{
-		cout << "usage: main videoFile startFrame numParticles w h detector "<<endl;
+		cout << "usage: main videoFile startFrame numParticles w h detector [--live] [--gray] [--evaltrain] [--lut] [--sparse] [--coarse] [--compiled] [--dupcache] [--regularized] [--rb] [--batched] [--half] [--budget N] [--offline N] [--states] [--reacquire K] [--modes K] [--arena] [--numa node] [--hugepages] [--meanshift] [--grid] [--fastmath 3..6] [--mathcheck] [--shape WxH:model]..."<<endl;
+	}
+	parseOptions(argc, argv);
+	if(argc>1 && isLiveSource(argv[1]))
+		liveMode=true;
+	// before anything is allocated or started
+	NumaStat numaStart={0, 0, 0};
+	if(numaNode>=0)
+	{
+		if(numaPin(numaNode))
+			cout << "Running on numa node " << numaNode << " of " << numaNodeCount() << endl;
+		else
+		{
+			cout << "Cannot run on numa node " << numaNode << endl;
+			numaNode=-1;
+		}
+		if(numaNode>=0)
+			numaReadStat(numaNode, numaStart);
 	}
 	int i,j;
 	// random walk motion model parameters (px, deg)
@@ -175,13 +797,36 @@ int main(int argc,char **argv )
 	
 	FILE *resultsNeff=fopen("results_neff.csv","w");
 	
+	FILE *resultsLive=fopen("results_live.csv","w");
+	
+	DetectionCache detectionCache;
+	ParticleGrid particleGrid;
+	vector<float> particleLik;
+	
 	
 	fprintf(resultsFile,"%s\n",argv[1]);
 	
 	// load video
-	VideoCapture cap(argv[1]);
+	VideoCapture cap;
+	LiveCapture live;
+	double frameStamp=0.0, prevFrameStamp=0.0;
+	double predictedDt=1.0; // frame time used by the last pf prediction
 	Mat temp; 
-	cap >> temp;
+	if(liveMode)
+	{
+		if(!liveCaptureOpen(live, argv[1]))
+		{
+			cout << "Cannot open live source " << argv[1] << endl;
+			return 1;
+		}
+		liveCaptureRead(live, temp, prevFrameStamp);
+		cout << "Live source, nominal frame period (ms): " << framePeriod << endl;
+	}
+	else
+	{
+		cap.open(argv[1]);
+		cap >> temp;
+	}
 	frameSize=temp.size();
 
 	fprintf(resultsFile,"0 0.0 0.0 0.0 0.0\n");
@@ -195,6 +840,23 @@ int main(int argc,char **argv )
 	Point prevDetection;
 	
 	int xx, yy;
+	if(argc>3 && atoi(argv[3])>0)
+		n_particle=atoi(argv[3]);
+	cout << "Particles: " << n_particle << (regularizedPF ? " (regularized)" : "")
+		 << (raoBlackwellized ? " (rao-blackwellized)" : "") << endl;
+	vector<RBFilter*> filters(1, &rbpf);
+	FilterBatch filterBatch;
+	filterBatch.rng=RNG((unsigned)cvGetTickCount ());
+	vector<float> trackNeff;
+	if(raoBlackwellized)
+	{
+		// nothing is localized yet, the first frame gets the whole budget
+		if(particleBudget>0)
+			n_particle=particleBudget;
+		poolInit(particlePool, n_particle, compactParticles);
+		cout << "Particle pool: " << (compactParticles ? 12 : 20) << " bytes per particle" << endl;
+		rbInit(rbpf, particlePool, 0, n_particle, frameSize);
+	}
 	// (4)Condensation To create a structure.
 	cond = cvCreateConDensation (n_stat, 0, n_particle);
 	
@@ -233,10 +895,12 @@ int main(int argc,char **argv )
 	cond->DynamMatr[15] = 1.0;
 	
 	// (8)Parameters to reconfigure the noise.
-	cvRandInit (&(cond->RandS[0]), -25, 25, (int) cvGetTickCount (),CV_RAND_UNI);
-	cvRandInit (&(cond->RandS[1]), -25, 25, (int) cvGetTickCount (),CV_RAND_UNI);
-	cvRandInit (&(cond->RandS[2]), -5, 5, (int) cvGetTickCount (),CV_RAND_UNI);
-	cvRandInit (&(cond->RandS[3]), -5, 5, (int) cvGetTickCount (),CV_RAND_UNI);
+	float posNoise=pfPosNoise(), velNoise=pfVelNoise();
+	cvRandInit (&(cond->RandS[0]), -posNoise, posNoise, (int) cvGetTickCount (),CV_RAND_UNI);
+	cvRandInit (&(cond->RandS[1]), -posNoise, posNoise, (int) cvGetTickCount (),CV_RAND_UNI);
+	cvRandInit (&(cond->RandS[2]), -velNoise, velNoise, (int) cvGetTickCount (),CV_RAND_UNI);
+	cvRandInit (&(cond->RandS[3]), -velNoise, velNoise, (int) cvGetTickCount (),CV_RAND_UNI);
+	RNG jitterRng((unsigned)cvGetTickCount ());
 	//	cvRandInit (&(cond->RandS[0]), -10, 10, (int) cvGetTickCount (),CV_RAND_UNI);
 	//	cvRandInit (&(cond->RandS[1]), -10, 10, (int) cvGetTickCount (),CV_RAND_UNI);
 	//	cvRandInit (&(cond->RandS[2]), -5, 5, (int) cvGetTickCount (),CV_RAND_UNI);
@@ -257,26 +921,45 @@ int main(int argc,char **argv )
 	cout << "hog window size: "<< windowsz.width << " " << windowsz.height<< endl;
 	cout << "hog window ratio: " <<wratio<<endl;
 	
-	HOGDescriptor hog(windowsz, Size(16,16), Size(8,8), Size(8,8),9,1,-1,0,0.2,true);
+	HogSvmDetector hogDetector(windowsz);
+	AcfDetector acfDetector(windowsz);
+	ObjectDetector *detector=&hogDetector;
 	
     vector<float> model;
     if(argc<7)
 	{
-		hog.setSVMDetector(HOGDescriptor::getDefaultPeopleDetector());
+		hogDetector.setModel(HOGDescriptor::getDefaultPeopleDetector());
 		cout << "Load default detector"<<endl;
     }
+	else if(strstr(argv[6],".acf")!=NULL)
+	{
+		cout << "Loaded acf model file: " << argv[6]<< endl;
+		if(!acfDetector.load(argv[6]))
+			cout << "Cannot read " << argv[6] << endl;
+		detector=&acfDetector;
+	}
 	else
 	{
 		cout << "Loaded model file: " << argv[6]<< endl;
 		loadSVMfromFile(argv[6], &model);
-		hog.setSVMDetector(model);			
+		hogDetector.setModel(model);			
+	}
+	for(size_t k=0; k<shapeSpecs.size(); k++)
+	{
+		Size win;
+		char file[256];
+		if(sscanf(shapeSpecs[k].c_str(), "%dx%d:%255s", &win.width, &win.height, file)!=3 ||
+		   !hogDetector.addShape(win, file))
+			cout << "Cannot use window shape " << shapeSpecs[k] << endl;
+		else
+			cout << "hog window shape: " << win.width << " " << win.height << " model " << file << endl;
 	}
 
 
 
     // skip frames at start
     Mat frame;
-    if(argc>2)
+    if(argc>2 && !liveMode)
     {
 		for (int i=0;i<atoi(argv[2]);i++)
 		{
@@ -326,12 +1009,27 @@ int main(int argc,char **argv )
 	Mat old_positives(Size(windowsz.width/2,windowsz.height/2),CV_8UC3);
 	
 	Point currDetection;
+	Rect lastDetection; // size of the tracked object for sparse scoring
+	bool lastAttemptFound=false; // offline schedule: the last detector run found the target
+	bool roiTracking=false; // the search roi follows a detection: sparse scoring is allowed
+	TrackMachine track;
+	if(reacquireSlices>0)
+		track.slices=reacquireSlices;
+	bool stateDetect=true; // the state machine wants the detector on this frame
+	ReacquireScan reacquire;
+	vector<Rect> modeRois; // search rois around the particle modes, searchRoi is their bounding box
+	vector<ParticleMode> modes;
+	vector<FrameSummary> offlineTrack;
 
 	bool doDetection=true;
 	
 	// main loop
 	while(1)
 	{
+		// last frame's temporaries are gone
+		if(frameArena)
+			arenaReset(*frameArena);
+		
 		// write info...
 		//system("clear");
 		if(automaticTraining)	cout << "Automatic Training		ON"<<endl;
@@ -345,17 +1043,48 @@ int main(int argc,char **argv )
 		
 
 		
-		cap >> frame;
+		// frame time in units of the nominal period, so the constant velocity
+		// model stays correct when the live source drops frames
+		double frameDt=1.0;
+		if(liveMode)
+		{
+			if(!liveCaptureRead(live, frame, frameStamp))
+				break;
+			frameDt=(frameStamp-prevFrameStamp)/framePeriod;
+			prevFrameStamp=frameStamp;
+			fprintf(resultsLive,"%d,%f,%ld\n",frameNumber,frameDt*framePeriod,live.dropped);
+			frameDt=MIN(frameDt, MAX_FRAME_DT);
+		}
+		else
+			cap >> frame;
 		if(!frame.data)
 		    break;
+		if(frameDt!=predictedDt)
+		{
+			// last prediction assumed predictedDt, move particles by the difference
+			for (int k = 0; k < cond->SamplesNum; k++) {
+				cond->flSamples[k][0] += (frameDt-predictedDt)*cond->flSamples[k][2];
+				cond->flSamples[k][1] += (frameDt-predictedDt)*cond->flSamples[k][3];
+			}
+			// next interval is expected to be like this one
+			cond->DynamMatr[2] = frameDt;
+			cond->DynamMatr[7] = frameDt;
+			predictedDt=frameDt;
+		}
 		Mat img2=frame.clone();
 		image=frame.clone();
-		Mat hogSearchROI=frame(searchRoi).clone(); // roi for hog getection
 		frameNumber++;
 		
 		// prediction phase???
 		if(!firstTime)
 		{
+			if(raoBlackwellized)
+			{
+				if(batchedFilters)
+					batchPredict(filterBatch, particlePool, filters, frameDt);
+				else
+					rbPredict(rbpf, frameDt);
+			}
 //			Size delta;
 //			delta.width=currDetection.x-prevDetection.x;
 //			delta.height=currDetection.y-prevDetection.y;
@@ -368,7 +1097,16 @@ int main(int argc,char **argv )
 //				}
 //			printf("Delta: %d %d\n",delta.width, delta.height);
 		}
-		else firstTime=false;
+		else
+		{
+			firstTime=false;
+			if(lutGradient)
+			{
+				Mat input;
+				hogInput(frame, input);
+				cout << "LUT gradient check: " << verifyLutGradient(hogDetector.hog, input) << " mismatches" << endl;
+			}
+		}
 
 		
 		//-------collecting-samples--------
@@ -380,7 +1118,7 @@ int main(int argc,char **argv )
 		
 		if(automaticAddSamples && frameNumber%skipAddSamples==0)
 		{
-			hogDetectAddSelection(image(searchRoi),hog);
+			detectAddSelection(image(searchRoi),*detector);
 			selection.x+=searchRoi.x;
 			selection.y+=searchRoi.y;
 			rectangle(img2,selection.tl(), selection.br(),Scalar(0,255,0),2);
@@ -498,12 +1236,9 @@ int main(int argc,char **argv )
 			cout << "got enought images, start training...\n";
 			fclose(posFile);
 			fclose(negFile);
-			hogTraining();
+			detector->retrain();
 			cout << "finished training...\n";
-			vector<float> model;
-			loadSVMfromFile("modelweight", &model);
-			hog.setSVMDetector(model);	
-			cout << "new model for HOG!\n";
+			cout << "new model for " << detector->name() << "!\n";
 			windowPosCount=0;
 			windowNegCount=0;
 			
@@ -529,32 +1264,79 @@ int main(int argc,char **argv )
 		
 		
 		// temp image for drawing
-		Mat temp(img2.size(),CV_8UC3);
+		Mat temp;
+		framePooled(temp);
+		temp.create(img2.size(),CV_8UC3);
 		temp.setTo(Scalar(0,0,0));	
 		
 		
 		
 		// measurement (hog detection)		
-		vector<Rect> found, found_filtered;
-		found.clear();found_filtered.clear();
+		vector<Rect> found;
+		FrameVector<Rect>::type found_filtered;
 		
 		
-		Mat heatMap(frame.size(),CV_8UC1);	
+		Mat heatMap;
+		framePooled(heatMap);
+		heatMap.create(frame.size(),CV_8UC1);	
 		heatMap.setTo(0);
 		//my_hog.detectMultiScale(frame, heatMap, found, 0, Size(8,8), Size(32,32), 1.05, 2, frameNumber);
 		
 		//hog.detectMultiScale(frame, found, 0, Size(8,8), Size(32,32), 1.05, 2);
 		t = (double)getTickCount();
-		hog.detectMultiScale(hogSearchROI, found, 0, Size(8,8), Size(32,32), 1.05, 2);
+		// reacquire slices and probes are narrow too, but must be scanned densely
+		Size objSize=roiTracking ? lastDetection.size() : Size();
+		bool cached=false;
+		// offline the smoother bridges the frames between detector runs; a target
+		// that is not (or no longer) found gets the detector every frame
+		bool scheduled=offlineDetectEvery==0 || !lastAttemptFound || frameNumber%offlineDetectEvery==0;
+		if(trackStates)
+			scheduled=scheduled && stateDetect;
+		DetectionCacheEntry cacheKey;
+		if(scheduled && dupCache)
+		{
+			cacheKey.fingerprint=frameFingerprint(frame(searchRoi));
+			cacheKey.roi=searchRoi;
+			if(modeRois.size()>1)
+				cacheKey.modeRois=modeRois;
+			cacheKey.objSize=objSize;
+			cacheKey.modelVersion=detector->modelVersion;
+			cacheKey.gray=grayDetection;
+			cached=detectionCacheLookup(detectionCache, cacheKey, found);
+		}
+		if(scheduled && !cached)
+		{
+			if(modeRois.size()>1)
+			{
+				// each mode box separately, results relative to the bounding box
+				for(size_t m=0; m<modeRois.size(); m++)
+				{
+					vector<Rect> inMode;
+					detector->detect(frame(modeRois[m]), modeRois[m].tl(), objSize, inMode);
+					for(size_t k=0; k<inMode.size(); k++)
+						found.push_back(inMode[k]+(modeRois[m].tl()-searchRoi.tl()));
+				}
+			}
+			else
+				detector->detect(frame(searchRoi), searchRoi.tl(), objSize, found);
+			if(dupCache)
+				detectionCacheStore(detectionCache, cacheKey, found);
+		}
 		t = (double)getTickCount() - t;
 		t=t*1000./cv::getTickFrequency();
 		
-		fprintf(resultsTime,"%d,%f\n",frameNumber,t);
+		fprintf(resultsTime,"%d,%f,%d,%d\n",frameNumber,t,grayDetection,cached);
+		if(scheduled)
+			lastAttemptFound=!found.empty();
+		if(cached)
+			cout << "repeated frame, cached detections (" << detectionCache.hits << " of "
+				 << detectionCache.hits+detectionCache.misses << " frames)" << endl;
 		
-		Mat heatMapCol(heatMap.size(),CV_8UC3);
-		vector<Mat> vm;
-		vm.push_back(heatMap);vm.push_back(heatMap);vm.push_back(heatMap);
-		merge(vm,heatMapCol);
+		Mat heatMapCol;
+		framePooled(heatMapCol);
+		heatMapCol.create(heatMap.size(),CV_8UC3);
+		Mat vm[3]={heatMap, heatMap, heatMap};
+		merge(vm,3,heatMapCol);
 		scaleAdd(heatMapCol,0.5,img2,heatMapCol);
 #ifndef HYPS_UPDATE	
 		imshow("heatMap",heatMap);
@@ -584,6 +1366,7 @@ int main(int argc,char **argv )
 			r.y+=searchRoi.y;
 			currDetection.x= r.x+r.width/2;
 			currDetection.y=r.y+r.height/2;
+			lastDetection=r;
 			//circle(temp, currDetection, 10, Scalar(0,255,255),4);
 			//-------------------------
 			rectangle(temp,r.tl(),r.br(),Scalar(0,0,255),2);
@@ -605,6 +1388,47 @@ int main(int argc,char **argv )
 			Mat res(result);imshow("result",res);	
 			// update phase
 			float total=0.0;
+			double tWeight=(double)getTickCount();
+			float sumWeightsSquare=0.0;
+			if(gridCulling)
+			{
+				// particles have not moved since the last detection of this frame
+				if(i==0)
+					buildParticleGrid(particleGrid, frameSize, 2*LIKELIHOOD_SUPPORT);
+				long evaluated=gridLikelihood(particleGrid, result, Point(r.x+r.width/2,r.y+r.height/2), particleLik);
+				cout << "Likelihood evaluated for " << evaluated << " of " << particleCount() << " particles" << endl;
+			}
+			else if(fastExpDegree>0)
+				particleLikelihoods(result, particleLik);
+			bool precomputed=gridCulling || fastExpDegree>0;
+			if(batchedFilters)
+			{
+				batchWeight(filterBatch, particlePool, filters, result, precomputed ? &particleLik : NULL, trackNeff);
+				sumWeightsSquare=1.0/trackNeff[0];
+				for (int k = 0; k < rbpf.n; k++)
+					circle (temp, cvPoint ((int) rbX(rbpf, k), (int) rbY(rbpf, k)), 2, CV_RGB (rbpf.w[k]*200, rbpf.w[k]*2000000, 255), -1,8,0);
+			}
+			else if(raoBlackwellized)
+			{
+				// the likelihood only depends on position, velocity is conditioned on it
+				for (int k = 0; k < rbpf.n; k++) {
+					xx = (int) rbpf.x[k];
+					yy = (int) rbpf.y[k];
+					float l = 0.0;
+					if (xx >= 0 && xx < w && yy >= 0 && yy < h) {
+						l = precomputed ? particleLik[k] : calc_likelihood (result, xx, yy);
+						circle (temp, cvPoint (xx, yy), 2, CV_RGB (l*200, l*2000000, 255), -1,8,0);
+					}
+					rbpf.w[k] *= l;
+					total += rbpf.w[k];
+				}
+				for (int k = 0; k < rbpf.n; k++) {
+					rbpf.w[k] = total>0.0 ? rbpf.w[k]/total : 1.0f/rbpf.n;
+					sumWeightsSquare+=rbpf.w[k]*rbpf.w[k];
+				}
+			}
+			else
+			{
 				for (i = 0; i < n_particle; i++) {
 					xx = (int) (cond->flSamples[i][0]);
 					yy = (int) (cond->flSamples[i][1]);
@@ -612,7 +1436,7 @@ int main(int argc,char **argv )
 						cond->flConfidence[i] = 0.0;
 					}
 					else {				
-						cond->flConfidence[i] = calc_likelihood (result, xx, yy);
+						cond->flConfidence[i] = precomputed ? particleLik[i] : calc_likelihood (result, xx, yy);
 						total+=cond->flConfidence[i];
 						if(cond->flConfidence[i]>0.0001)
 							printf("conf %f\n",cond->flConfidence[i]);
@@ -620,17 +1444,20 @@ int main(int argc,char **argv )
 					}
 				}
 			
-			//normalize weights
-			float sumWeightsSquare=0.0;
-			for (i = 0; i < n_particle; i++)
-			{
-				cond->flConfidence[i]/=total;
-				sumWeightsSquare+=cond->flConfidence[i]*cond->flConfidence[i];
+				//normalize weights
+				for (i = 0; i < n_particle; i++)
+				{
+					cond->flConfidence[i]/=total;
+					sumWeightsSquare+=cond->flConfidence[i]*cond->flConfidence[i];
+				}
 			}
 			
+			weightTimeSum+=((double)getTickCount()-tWeight)*1000./getTickFrequency();
+			weightFrames++;
+			
 			//neff
 			Neff=1.0/sumWeightsSquare;
-			Neff /= (float)n_particle;
+			Neff /= (float)particleCount();
 			
 			fprintf(resultsCenterFile,"%d, %d, %d\n",	frameNumber, currDetection.x,currDetection.y);	
 			fprintf(resultsNeff,"%f\n",Neff);
@@ -639,6 +1466,7 @@ int main(int argc,char **argv )
 			searchRoi.height=r.height*2;
 			searchRoi.x=r.x-r.width/2;
 			searchRoi.y=r.y-r.height/2;
+			roiTracking=true;
 			if(searchRoi.x<0) searchRoi.x=0;
 			if(searchRoi.y<0) searchRoi.y=0;
 			if(searchRoi.x+searchRoi.width>frameSize.width) searchRoi.width=frameSize.width-searchRoi.x;
@@ -648,14 +1476,30 @@ int main(int argc,char **argv )
 				
 			}
 	
-		if(!foundAtLeastOne)
+		// frames the offline schedule skips keep the roi of the last detection,
+		// the state machine plans the roi itself
+		if(!foundAtLeastOne && scheduled && !trackStates)
 		{
-			searchRoi.width=frameSize.width;
-			searchRoi.height=frameSize.height;
-			searchRoi.x=0;
-			searchRoi.y=0;
+			roiTracking=false;
+			if(reacquireSlices>0)
+			{
+				// one slice per frame instead of the whole frame
+				Size objSize=lastDetection.width>0 ? lastDetection.size() : windowsz;
+				if(reacquire.area!=frameSize || reacquire.objSize!=objSize)
+					reacquireInit(reacquire, frameSize, objSize, reacquireSlices);
+				searchRoi=reacquireNext(reacquire);
+			}
+			else
+			{
+				searchRoi.width=frameSize.width;
+				searchRoi.height=frameSize.height;
+				searchRoi.x=0;
+				searchRoi.y=0;
+			}
 			fprintf(resultsCenterFile,"%d,0.0,0.0",	frameNumber);
 		}
+		else if(foundAtLeastOne && reacquireSlices>0)
+			reacquireRestart(reacquire, currDetection);
 		else {
 			
 		}
@@ -665,15 +1509,143 @@ int main(int argc,char **argv )
 		
 		
 		// resample
-		cvConDensUpdateByTime (cond);
+		if(!foundAtLeastOne && !raoBlackwellized)
+		{
+			// nothing reweighted the particles: the weights left from the last
+			// detection belong to particles resampled since
+			for (int k = 0; k < cond->SamplesNum; k++)
+				cond->flConfidence[k] = 1.f/cond->SamplesNum;
+		}
+		float kernel[16];
+		bool regularize=regularizedPF && !raoBlackwellized && foundAtLeastOne && kernelBandwidth(cond, kernel);
+		if(offlineDetectEvery>0)
+		{
+			// posterior of this frame: detection weights, or uniform over the
+			// predicted particles when nothing reweighted them
+			FrameSummary fs;
+			fs.frame=frameNumber;
+			fs.dt=frameDt;
+			fs.detected=foundAtLeastOne;
+			summarizeFilter(fs, foundAtLeastOne);
+			offlineTrack.push_back(fs);
+		}
+		
+		float state[4];
+		Point2f mode(-1.f, -1.f);
+		if(meanShiftEstimate)
+		{
+			// on the weighted set of this frame, before resampling replaces it;
+			// kernel of a quarter of the object width
+			float bandwidth=lastDetection.width>0 ? lastDetection.width/4.f : 16.f;
+			Point2f start;
+			if(foundAtLeastOne)
+			{
+				// from the heaviest particle: the weighted mean of a bimodal set lies
+				// between the modes, out of reach of the kernel
+				int best=0;
+				for(int k=1; k<particleCount(); k++)
+					if(particleWeight(k)>particleWeight(best))
+						best=k;
+				start=particlePosition(best);
+			}
+			else if(raoBlackwellized)
+			{
+				rbEstimate(rbpf, state);
+				start=Point2f(state[0], state[1]);
+			}
+			else
+			{
+				double sx=0.0, sy=0.0, sw=0.0;
+				for (int k = 0; k < cond->SamplesNum; k++) {
+					sx+=cond->flConfidence[k]*cond->flSamples[k][0];
+					sy+=cond->flConfidence[k]*cond->flSamples[k][1];
+					sw+=cond->flConfidence[k];
+				}
+				start=sw>0.0 ? Point2f((float)(sx/sw), (float)(sy/sw)) : Point2f(w/2, h/2);
+			}
+			mode=meanShiftMode(start, bandwidth, 5);
+		}
+		if(multiModes>0)
+		{
+			// on the weighted set of this frame like mean shift; cells of half the object
+			float cell=lastDetection.width>0 ? lastDetection.width/2.f : 32.f;
+			extractModes(cell, multiModes, foundAtLeastOne, modes);
+			if(!modes.empty())
+				mode=modes[0].center;
+			for(size_t m=0; m<modes.size(); m++)
+				cout << "Mode " << m << ": " << modes[m].center.x << " " << modes[m].center.y
+					 << " mass " << modes[m].mass << endl;
+		}
+		if(raoBlackwellized)
+		{
+			// posterior of this frame, then every filter is resampled into its
+			// share of the budget (without a detection the weights are uniform)
+			rbEstimate(rbpf, state);
+			rbpf.missed=foundAtLeastOne ? 0 : rbpf.missed+1;
+			scheduleParticles(particlePool, filters, particleBudget);
+		}
+		else
+		{
+			cvConDensUpdateByTime (cond);
+			if(regularize)
+				jitterParticles(cond, kernel, jitterRng);
+			for (int k = 0; k < 4; k++)
+				state[k] = cond->State[k];
+		}
 		
 		
 		//adapt_num_particles(n_particle,Neff,frameSize);
 		
 		//get best hyp
-		Point estimatedPosition((int)cond->State[0], (int)cond->State[1]);
+		if(mode.x>=0.f)
+		{
+			state[0]=mode.x;
+			state[1]=mode.y;
+		}
+		Point estimatedPosition((int)state[0], (int)state[1]);
 		cout << "Estimated position: "<< estimatedPosition.x << " "<< estimatedPosition.y <<endl;
 		fprintf(resultsPf,"%d, %d\n", estimatedPosition.x,estimatedPosition.y);
+		if(foundAtLeastOne)
+		{
+			double ex=estimatedPosition.x-currDetection.x, ey=estimatedPosition.y-currDetection.y;
+			pfErrorSum+=sqrt(ex*ex+ey*ey);
+			pfErrorFrames++;
+		}
+		if(trackStates)
+		{
+			// state for the next frame, then its roi (tracking keeps the detection roi)
+			TrackState before=track.state;
+			trackUpdate(track, scheduled, foundAtLeastOne, Neff);
+			if(track.state!=before)
+				cout << "Track " << trackStateName(before) << " -> " << trackStateName(track.state) << endl;
+			Size objSize=lastDetection.width>0 ? lastDetection.size() : windowsz;
+			stateDetect=trackPlan(track, estimatedPosition, objSize, frameSize, searchRoi);
+			roiTracking=track.state==TRACK_TRACKING;
+		}
+		modeRois.clear();
+		if(multiModes>0 && foundAtLeastOne)
+		{
+			// next roi: a compact box on every mode with a tenth of the weight,
+			// instead of one box around the detection
+			Size objSize=lastDetection.size();
+			Rect frameRect(Point(0,0), frameSize), bounds;
+			for(size_t m=0; m<modes.size(); m++)
+			{
+				if(modes[m].mass<0.1f)
+					continue;
+				int bw=cvRound(objSize.width*1.5f+4*modes[m].spread.x);
+				int bh=cvRound(objSize.height*1.5f+4*modes[m].spread.y);
+				Rect box=Rect(cvRound(modes[m].center.x)-bw/2, cvRound(modes[m].center.y)-bh/2, bw, bh) & frameRect;
+				if(box.width<objSize.width || box.height<objSize.height)
+					continue;
+				modeRois.push_back(box);
+				bounds=modeRois.size()==1 ? box : (bounds | box);
+			}
+			if(!modeRois.empty())
+				searchRoi=bounds;
+			for(size_t m=0; m<modeRois.size(); m++)
+				rectangle(temp,modeRois[m].tl(),modeRois[m].br(),Scalar(255,0,255),1);
+		}
 		
 		// show info on image
 		// show pf state
@@ -718,13 +1690,15 @@ int main(int argc,char **argv )
 		vidout << img2;	
 
 		// write info on image
-		Mat imgInfo(500,200,CV_8UC3);
+		Mat imgInfo;
+		framePooled(imgInfo);
+		imgInfo.create(500,200,CV_8UC3);
 		imgInfo.setTo(Scalar(0,0,0));
 
 		sprintf(s,"Frame number: %d",frameNumber-1);
 		putText(imgInfo,s,Point(2,10),CV_FONT_HERSHEY_PLAIN,0.8,Scalar(0,255,255));
 		
-		sprintf(s,"Particles: %d", (int)((float)n_particle*(1.0-Neff)));
+		sprintf(s,"Particles: %d", (int)((float)particleCount()*(1.0-Neff)));
 		putText(imgInfo,s,Point(2,20),CV_FONT_HERSHEY_PLAIN,0.8,Scalar(0,255,255));
 //		
 //		sprintf(s,"Best hyp: %d %d", ix,iy);
@@ -760,8 +1734,18 @@ int main(int argc,char **argv )
 			putText(imgInfo,"No detection",Point(2,120),CV_FONT_HERSHEY_PLAIN,0.8,Scalar(0,0,255));
 		sprintf(s,"Search roi: %d %d %d %d",searchRoi.x,searchRoi.y,searchRoi.width,searchRoi.height);
 		putText(imgInfo,s,Point(2,130),CV_FONT_HERSHEY_PLAIN,0.8,Scalar(0,255,255));
-		sprintf(s,"Detection time (ms): %f",t);
+		sprintf(s,"Detection time (ms): %f %s",t,grayDetection ? "gray" : "");
 		putText(imgInfo,s,Point(2,140),CV_FONT_HERSHEY_PLAIN,0.8,Scalar(0,255,255));
+		if(liveMode)
+		{
+			sprintf(s,"Dropped frames: %ld",live.dropped);
+			putText(imgInfo,s,Point(2,150),CV_FONT_HERSHEY_PLAIN,0.8,Scalar(0,255,255));
+		}
+		if(trackStates)
+		{
+			sprintf(s,"Track: %s (%d frames)%s",trackStateName(track.state),track.stateFrames,stateDetect ? "" : " coasting");
+			putText(imgInfo,s,Point(2,160),CV_FONT_HERSHEY_PLAIN,0.8,Scalar(0,255,255));
+		}
 
 		imshow("Info",imgInfo);
 		
@@ -771,15 +1755,28 @@ int main(int argc,char **argv )
 		char c;		
 		if(pause)
 			c = (char)waitKey(0);
+		else if(liveMode || offlineDetectEvery>0)
+			c = (char)waitKey(1); // the source sets the pace, offline as fast as possible
 		else
 			c = (char)waitKey(200); //25 fps?
         
 		if( c == 27 )
 		{
+			reportFilterAccuracy();
+			reportFrameMemory();
+			reportNuma(numaStart);
+			if(offlineDetectEvery>0)
+			{
+				smoothTrack(offlineTrack);
+				writeSmoothedTrack(offlineTrack, "results_smoothed.csv");
+			}
+			if(liveMode)
+				liveCaptureClose(live);
 			fclose(resultsFile);
 			fclose(resultsCenterFile);
 			fclose(resultsPf);
 			fclose(resultsTime);
+			fclose(resultsLive);
             return 0;
 		}
 		if( c == ' ')
@@ -788,12 +1785,27 @@ int main(int argc,char **argv )
 			startTraining=true;
 		if(c=='h')
 			detect=!detect;
+		if(c=='g')
+		{
+			grayDetection=!grayDetection;
+			cout << "Gray detection " << (grayDetection ? "ON" : "OFF") << endl;
+		}
 		if(c=='a')
 			automaticTraining=!automaticTraining;
 		if(c=='s')
 			automaticAddSamples=!automaticAddSamples;
+		if(c=='b')
+		{
+			FILE *resultsBench=fopen("results_bench.csv","a");
+			benchmarkModelScoring(hogDetector, frame, resultsBench);
+			fclose(resultsBench);
+		}
 		if(c=='r')
 		{
+			lastDetection=Rect();
+			roiTracking=false;
+			track=TrackMachine();
+			stateDetect=true;
 			//pf_init_map(pf, m_map);
 			searchRoi.width=frameSize.width;
 			searchRoi.height=frameSize.height;
@@ -805,7 +1817,18 @@ int main(int argc,char **argv )
 			firstTime=false;
 	}
 
+	reportFilterAccuracy();
+	reportFrameMemory();
+	reportNuma(numaStart);
+	if(offlineDetectEvery>0)
+	{
+		smoothTrack(offlineTrack);
+		writeSmoothedTrack(offlineTrack, "results_smoothed.csv");
+	}
+	if(liveMode)
+		liveCaptureClose(live);
 	fclose(resultsNeff);
+	fclose(resultsLive);
 		fclose(resultsFile);
 		fclose(resultsCenterFile);
 		fclose(resultsPf);
@@ -816,76 +1839,3395 @@ int main(int argc,char **argv )
 
 
 
-//--------hog-detection--------------------
+//--------regularized-pf--------------------
+// Regularized resampling (Musso et al.): resampled particles are drawn from a
+// gaussian kernel estimate of the posterior instead of being exact duplicates,
+// so a few hundred particles keep enough distinct values. Kernel covariance is
+// the weighted sample covariance scaled by the optimal gaussian bandwidth.
 
-void hogDetect(Mat &img, HOGDescriptor &hog)
+// h*chol(cov) of the weighted samples into L (4x4 row major, lower triangular),
+// from the confidences set by the last update. False when they are all zero
+bool kernelBandwidth(const CvConDensation *cd, float* L)
 {
-	vector<Rect> found, found_filtered;
-	double t = (double)getTickCount();
-	// run the detector with default parameters. to get a higher hit-rate
-	// (and more false alarms, respectively), decrease the hitThreshold and
-	// groupThreshold (set groupThreshold to 0 to turn off the grouping completely).
-	hog.detectMultiScale(img, found, 0, Size(8,8), Size(32,32), 1.05, 2);
-	t = (double)getTickCount() - t;
-	printf("HOG detection time = %gms\n", t*1000./cv::getTickFrequency());
-	size_t i, j;
-	for( i = 0; i < found.size(); i++ )
+	const int d=4;
+	double mean[d]={0,0,0,0}, cov[d][d], sum=0.0;
+	for(int k=0; k<cd->SamplesNum; k++)
 	{
-		Rect r = found[i];
-		for( j = 0; j < found.size(); j++ )
-			if( j != i && (r & found[j]) == r)
+		double wk=cd->flConfidence[k];
+		sum+=wk;
+		for(int a=0; a<d; a++)
+			mean[a]+=wk*cd->flSamples[k][a];
+	}
+	if(!(sum>0.0))
+		return false;
+	for(int a=0; a<d; a++)
+		mean[a]/=sum;
+	for(int a=0; a<d; a++)
+		for(int b=0; b<d; b++)
+			cov[a][b]=0.0;
+	for(int k=0; k<cd->SamplesNum; k++)
+	{
+		double wk=cd->flConfidence[k]/sum, dv[d];
+		for(int a=0; a<d; a++)
+			dv[a]=cd->flSamples[k][a]-mean[a];
+		for(int a=0; a<d; a++)
+			for(int b=0; b<=a; b++)
+				cov[a][b]+=wk*dv[a]*dv[b];
+	}
+	
+	// a collapsed posterior still gets some spread: half a pixel, 0.1 px/frame
+	cov[0][0]+=0.25;
+	cov[1][1]+=0.25;
+	cov[2][2]+=0.01;
+	cov[3][3]+=0.01;
+	
+	double h=pow(4.0/(cd->SamplesNum*(d+2.0)), 1.0/(d+4.0));
+	for(int a=0; a<d; a++)
+		for(int b=0; b<d; b++)
+		{
+			if(b>a)
+			{
+				L[a*d+b]=0.f;
+				continue;
+			}
+			double v=cov[a][b];
+			for(int k=0; k<b; k++)
+				v-=L[a*d+k]*L[b*d+k];
+			if(a==b)
+				L[a*d+b]=(float)sqrt(MAX(v, 1e-6));
+			else
+				L[a*d+b]=(float)(v/L[b*d+b]);
+		}
+	for(int a=0; a<d*d; a++)
+		L[a]*=(float)h;
+	return true;
+}
+
+// adds L*eps, eps standard normal, to every (resampled) particle
+void jitterParticles(CvConDensation *cd, const float* L, RNG &rng)
+{
+	for(int k=0; k<cd->SamplesNum; k++)
+	{
+		float eps[4]={(float)rng.gaussian(1.0), (float)rng.gaussian(1.0),
+					  (float)rng.gaussian(1.0), (float)rng.gaussian(1.0)};
+		for(int a=0; a<4; a++)
+		{
+			float v=0.f;
+			for(int b=0; b<=a; b++)
+				v+=L[a*4+b]*eps[b];
+			cd->flSamples[k][a]+=v;
+		}
+	}
+}
+
+// the numbers to compare runs with different particle counts / filters
+void reportFilterAccuracy()
+{
+	cout << "Filter: " << n_particle << " particles" << (regularizedPF ? " (regularized)" : "")
+		 << (raoBlackwellized ? " (rao-blackwellized)" : "") << (meanShiftEstimate ? " (mean shift)" : "")
+		 << (gridCulling ? " (grid culling)" : "");
+	if(pfErrorFrames>0)
+		cout << ", mean estimate-detection error " << pfErrorSum/pfErrorFrames << " px over "
+			 << pfErrorFrames << " frames";
+	if(weightFrames>0)
+		cout << ", weighting " << weightTimeSum/weightFrames << " ms/frame";
+	cout << endl;
+	FILE* out=fopen("results_filter.csv","a");
+	if(out!=NULL)
+	{
+		fprintf(out, "%d,%d,%d,%d,%f,%d,%f\n", n_particle, regularizedPF, raoBlackwellized, meanShiftEstimate,
+				pfErrorFrames>0 ? pfErrorSum/pfErrorFrames : 0.0, pfErrorFrames,
+				weightFrames>0 ? weightTimeSum/weightFrames : 0.0);
+		fclose(out);
+	}
+}
+
+
+
+//--------rao-blackwellized-pf--------------------
+// State (x, y, vx, vy) with x' = x + vx*dt + n_pos, v' = v + n_vel. Given the
+// sampled positions the velocity is linear-gaussian, so each particle keeps a
+// kalman estimate of it and only the positions are sampled: position noise is
+// drawn from the marginal (velocity uncertainty included), then the sampled
+// displacement is the kalman measurement of the velocity.
+
+void poolInit(ParticlePool &pool, int capacity, bool compact)
+{
+	pool.capacity=capacity;
+	pool.bank=0;
+	pool.compact=compact;
+	for(int b=0; b<2; b++)
+	{
+		pool.data[b].assign((compact ? 1 : POOL_FIELDS)*capacity, 0.f);
+		pool.half[b].assign(compact ? POOL_W*capacity : 0, 0);
+	}
+}
+
+static void rbAttach(RBFilter &f, ParticlePool &pool, int b, int ofs, int n)
+{
+	f.n=n;
+	f.ofs=ofs;
+	f.w=pool.field(b, POOL_W)+ofs;
+	if(pool.compact)
+	{
+		f.x=f.y=f.vx=f.vy=NULL;
+		f.hx=pool.halfField(b, POOL_X)+ofs;
+		f.hy=pool.halfField(b, POOL_Y)+ofs;
+		f.hvx=pool.halfField(b, POOL_VX)+ofs;
+		f.hvy=pool.halfField(b, POOL_VY)+ofs;
+	}
+	else
+	{
+		f.hx=f.hy=f.hvx=f.hvy=NULL;
+		f.x=pool.field(b, POOL_X)+ofs;
+		f.y=pool.field(b, POOL_Y)+ofs;
+		f.vx=pool.field(b, POOL_VX)+ofs;
+		f.vy=pool.field(b, POOL_VY)+ofs;
+	}
+}
+
+// particle k of a filter, whatever its storage
+float rbX(const RBFilter &f, int k) { return f.x ? f.x[k] : f.ox+halfToFloat(f.hx[k]); }
+float rbY(const RBFilter &f, int k) { return f.y ? f.y[k] : f.oy+halfToFloat(f.hy[k]); }
+float rbVX(const RBFilter &f, int k) { return f.vx ? f.vx[k] : halfToFloat(f.hvx[k]); }
+float rbVY(const RBFilter &f, int k) { return f.vy ? f.vy[k] : halfToFloat(f.hvy[k]); }
+
+static void rbSet(RBFilter &f, int k, float x, float y, float vx, float vy)
+{
+	if(f.x)
+	{
+		f.x[k]=x;
+		f.y[k]=y;
+		f.vx[k]=vx;
+		f.vy[k]=vy;
+		return;
+	}
+	f.hx[k]=floatToHalf(x-f.ox);
+	f.hy[k]=floatToHalf(y-f.oy);
+	f.hvx[k]=floatToHalf(vx);
+	f.hvy[k]=floatToHalf(vy);
+}
+
+// positions uniform over the frame, velocities N(0, P) as the uniform +-10 init,
+// in particles [ofs, ofs+n) of the current pool bank
+void rbInit(RBFilter &f, ParticlePool &pool, int ofs, int n, Size area)
+{
+	rbAttach(f, pool, pool.bank, ofs, n);
+	f.ox=area.width/2.f;
+	f.oy=area.height/2.f;
+	std::fill(f.w, f.w+n, 1.f/n);
+	f.missed=0;
+	f.P=100.f/3.f;
+	f.q=1.f;
+	f.sigmaPos=6.f;
+	f.rng=RNG((unsigned)cvGetTickCount());
+	for(int k=0; k<n; k++)
+		rbSet(f, k, f.rng.uniform(0.f, (float)area.width), f.rng.uniform(0.f, (float)area.height), 0.f, 0.f);
+}
+
+void rbPredict(RBFilter &f, double dt)
+{
+	float Pp=f.P+f.q;										// velocity prior variance
+	float S=(float)(dt*dt)*Pp+f.sigmaPos*f.sigmaPos;		// marginal displacement variance
+	float K=Pp*(float)dt/S;									// velocity gain
+	float sd=sqrt(S);
+	for(int k=0; k<f.n; k++)
+	{
+		float ex=(float)f.rng.gaussian(sd), ey=(float)f.rng.gaussian(sd);
+		// displacement is vx*dt+ex, the innovation of the velocity measurement is ex
+		f.x[k]+=f.vx[k]*(float)dt+ex;
+		f.y[k]+=f.vy[k]*(float)dt+ey;
+		f.vx[k]+=K*ex;
+		f.vy[k]+=K*ey;
+	}
+	f.P=(1.f-K*(float)dt)*Pp;
+}
+
+// weighted mean of positions and velocity means
+void rbEstimate(const RBFilter &f, float* state)
+{
+	double s[4]={0,0,0,0};
+	for(int k=0; k<f.n; k++)
+	{
+		s[0]+=f.w[k]*rbX(f, k);
+		s[1]+=f.w[k]*rbY(f, k);
+		s[2]+=f.w[k]*rbVX(f, k);
+		s[3]+=f.w[k]*rbVY(f, k);
+	}
+	for(int a=0; a<4; a++)
+		state[a]=(float)s[a];
+}
+
+// systematic resampling to n particles at ofs of the other pool bank, the
+// copies keep their velocity estimate. With uniform weights and the same n
+// it is a plain copy. Compact filters move their origin to the new mean, so
+// the float16 offsets stay small (and precise)
+void rbResample(RBFilter &f, ParticlePool &pool, int ofs, int n)
+{
+	RBFilter dst=f;
+	rbAttach(dst, pool, pool.bank^1, ofs, n);
+	if(pool.compact)
+	{
+		float state[4];
+		rbEstimate(f, state);
+		dst.ox=state[0];
+		dst.oy=state[1];
+	}
+	float u=f.rng.uniform(0.f, 1.f/n), c=f.w[0];
+	dst.rng=f.rng;
+	int j=0;
+	for(int k=0; k<n; k++)
+	{
+		float target=u+(float)k/n;
+		while(c<target && j<f.n-1)
+			c+=f.w[++j];
+		if(f.x)
+		{
+			dst.x[k]=f.x[j];
+			dst.y[k]=f.y[j];
+			dst.vx[k]=f.vx[j];
+			dst.vy[k]=f.vy[j];
+		}
+		else
+		{
+			dst.hx[k]=floatToHalf(rbX(f, j)-dst.ox);
+			dst.hy[k]=floatToHalf(rbY(f, j)-dst.oy);
+			dst.hvx[k]=f.hvx[j];
+			dst.hvy[k]=f.hvy[j];
+		}
+	}
+	std::fill(dst.w, dst.w+n, 1.f/n);
+	f=dst;
+}
+
+// how many particles the filter needs, in px^2 of position spread: product of
+// the weighted std devs, inflated by weight degeneracy (1/normalized N_eff) and
+// by the frames without a detection (the target may have moved anywhere)
+float rbUncertainty(const RBFilter &f)
+{
+	double mx=0.0, my=0.0, sw2=0.0;
+	for(int k=0; k<f.n; k++)
+	{
+		mx+=f.w[k]*rbX(f, k);
+		my+=f.w[k]*rbY(f, k);
+		sw2+=f.w[k]*f.w[k];
+	}
+	double vx=0.0, vy=0.0;
+	for(int k=0; k<f.n; k++)
+	{
+		double dx=rbX(f, k)-mx, dy=rbY(f, k)-my;
+		vx+=f.w[k]*dx*dx;
+		vy+=f.w[k]*dy*dy;
+	}
+	double neffNorm=sw2>0.0 ? 1.0/(sw2*f.n) : 1.0;
+	return (float)(sqrt(vx*vy)/MAX(neffNorm, 0.01)*(1.0+f.missed/5.0));
+}
+
+// Budget scheduler: each filter asks for particlesPerPx2 particles per px^2 of
+// uncertainty (at least minParticles); when the asks exceed the budget they
+// are scaled down proportionally, so particles go to the filters that are
+// hard to track. Filters are then resampled to their counts, packed in the
+// other bank, and the banks swap. budget<=0 keeps every filter's count
+void scheduleParticles(ParticlePool &pool, vector<RBFilter*> &filters, int budget)
+{
+	const float particlesPerPx2=0.5f;
+	size_t nf=filters.size();
+	vector<double> ask(nf);
+	double total=0.0;
+	for(size_t i=0; i<nf; i++)
+	{
+		ask[i]=budget>0 ? MAX((double)minParticles, particlesPerPx2*rbUncertainty(*filters[i])) : filters[i]->n;
+		total+=ask[i];
+	}
+	double scale=budget>0 && total>budget ? budget/total : 1.0;
+	int minShare=budget>0 ? MIN(minParticles, budget/(int)nf) : 0;
+	int ofs=0;
+	for(size_t i=0; i<nf; i++)
+	{
+		int n=MAX(minShare, (int)(ask[i]*scale));
+		n=MIN(n, pool.capacity-ofs-(int)(nf-1-i)*minShare);
+		rbResample(*filters[i], pool, ofs, n);
+		ofs+=n;
+	}
+	pool.bank^=1;
+}
+
+
+
+//--------half-precision--------------------
+// float16 conversions for compact particle pools: F16C (vcvtph2ps/vcvtps2ph) 4
+// at a time when the cpu has it, bit manipulation otherwise. Both round to
+// nearest even, so the two paths store the same bits.
+
+bool cpuHasF16C()
+{
+	static int has=-1;
+	if(has<0)
+	{
+		__builtin_cpu_init();
+		has=__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c") ? 1 : 0;
+	}
+	return has==1;
+}
+
+float halfToFloat(unsigned short h)
+{
+	unsigned int s=(unsigned int)(h&0x8000)<<16, e=(h>>10)&0x1f, m=h&0x3ff, bits;
+	if(e==0)
+	{
+		if(m==0)
+			bits=s;
+		else
+		{
+			// subnormal, normalize the mantissa
+			e=127-15+1;
+			while(!(m&0x400))
+			{
+				m<<=1;
+				e--;
+			}
+			bits=s|(e<<23)|((m&0x3ff)<<13);
+		}
+	}
+	else if(e==31)
+		bits=s|0x7f800000|(m<<13);
+	else
+		bits=s|((e+127-15)<<23)|(m<<13);
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+unsigned short floatToHalf(float f)
+{
+	unsigned int b;
+	memcpy(&b, &f, sizeof(b));
+	unsigned int s=(b>>16)&0x8000, m=b&0x7fffff;
+	int e=(int)((b>>23)&0xff)-127+15;
+	if(((b>>23)&0xff)==0xff)
+		return s|0x7c00|(m ? 0x200 : 0);
+	if(e>=31)
+		return s|0x7c00;
+	if(e<=0)
+	{
+		if(e<-10)
+			return s;
+		m|=0x800000;
+		int shift=14-e;
+		unsigned int hm=m>>shift, rem=m&((1u<<shift)-1), halfway=1u<<(shift-1);
+		if(rem>halfway || (rem==halfway && (hm&1)))
+			hm++;
+		return s|hm;
+	}
+	unsigned int hm=m>>13, rem=m&0x1fff;
+	unsigned int h=s|(e<<10)|hm;
+	if(rem>0x1000 || (rem==0x1000 && (hm&1)))
+		h++; // may carry into the exponent, which is the right rounding
+	return (unsigned short)h;
+}
+
+__attribute__((target("f16c")))
+static void decodeHalfF16C(const unsigned short* h, int n, float origin, float* out)
+{
+	__m128 o=_mm_set1_ps(origin);
+	int i=0;
+	for(; i+4<=n; i+=4)
+		_mm_storeu_ps(out+i, _mm_add_ps(o, _mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)(h+i)))));
+	for(; i<n; i++)
+		out[i]=origin+halfToFloat(h[i]);
+}
+
+// origin + h[i] as float
+void decodeHalf(const unsigned short* h, int n, float origin, float* out)
+{
+	if(cpuHasF16C())
+	{
+		decodeHalfF16C(h, n, origin, out);
+		return;
+	}
+	for(int i=0; i<n; i++)
+		out[i]=origin+halfToFloat(h[i]);
+}
+
+// batchPredict on float16 particles [from, n): float arithmetic, float16 storage
+void predictHalf(unsigned short *x, unsigned short *y, unsigned short *vx, unsigned short *vy,
+				 const float *ex, const float *ey, const float *sd, const float *gain, float dt, int from, int n)
+{
+	for(int i=from; i<n; i++)
+	{
+		float dx=sd[i]*ex[i], dy=sd[i]*ey[i];
+		float fvx=halfToFloat(vx[i]), fvy=halfToFloat(vy[i]);
+		x[i]=floatToHalf(halfToFloat(x[i])+fvx*dt+dx);
+		y[i]=floatToHalf(halfToFloat(y[i])+fvy*dt+dy);
+		vx[i]=floatToHalf(fvx+gain[i]*dx);
+		vy[i]=floatToHalf(fvy+gain[i]*dy);
+	}
+}
+
+__attribute__((target("f16c")))
+void predictHalfF16C(unsigned short *x, unsigned short *y, unsigned short *vx, unsigned short *vy,
+					 const float *ex, const float *ey, const float *sd, const float *gain, float dt, int n)
+{
+	__m128 vdt=_mm_set1_ps(dt);
+	int i=0;
+	for(; i+4<=n; i+=4)
+	{
+		__m128 s=_mm_loadu_ps(sd+i), k=_mm_loadu_ps(gain+i);
+		__m128 dx=_mm_mul_ps(s, _mm_loadu_ps(ex+i)), dy=_mm_mul_ps(s, _mm_loadu_ps(ey+i));
+		__m128 xi=_mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)(x+i)));
+		__m128 yi=_mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)(y+i)));
+		__m128 vxi=_mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)(vx+i)));
+		__m128 vyi=_mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)(vy+i)));
+		xi=_mm_add_ps(xi, _mm_add_ps(_mm_mul_ps(vxi, vdt), dx));
+		yi=_mm_add_ps(yi, _mm_add_ps(_mm_mul_ps(vyi, vdt), dy));
+		vxi=_mm_add_ps(vxi, _mm_mul_ps(k, dx));
+		vyi=_mm_add_ps(vyi, _mm_mul_ps(k, dy));
+		_mm_storel_epi64((__m128i*)(x+i), _mm_cvtps_ph(xi, _MM_FROUND_TO_NEAREST_INT));
+		_mm_storel_epi64((__m128i*)(y+i), _mm_cvtps_ph(yi, _MM_FROUND_TO_NEAREST_INT));
+		_mm_storel_epi64((__m128i*)(vx+i), _mm_cvtps_ph(vxi, _MM_FROUND_TO_NEAREST_INT));
+		_mm_storel_epi64((__m128i*)(vy+i), _mm_cvtps_ph(vyi, _MM_FROUND_TO_NEAREST_INT));
+	}
+	predictHalf(x, y, vx, vy, ex, ey, sd, gain, dt, i, n);
+}
+
+
+
+//--------batched-filters--------------------
+// With many tracks of a few hundred particles the per-filter loops are short.
+// The pool already packs all tracks in one bank, so prediction and weighting
+// run as single passes over it (4 particles per SSE step) with the per-track
+// constants expanded per particle; normalization and N_eff are segmented sums.
+
+static void batchSegments(FilterBatch &b, ParticlePool &pool, vector<RBFilter*> &filters)
+{
+	b.seg.resize(filters.size()+1);
+	for(size_t t=0; t<filters.size(); t++)
+		b.seg[t]=filters[t]->ofs;
+	b.seg[filters.size()]=b.seg.empty() ? 0 : b.seg[filters.size()-1]+filters.back()->n;
+}
+
+// sum of v[0..n)
+static float sumSSE(const float* v, int n)
+{
+	__m128 acc=_mm_setzero_ps();
+	int i=0;
+	for(; i+4<=n; i+=4)
+		acc=_mm_add_ps(acc, _mm_loadu_ps(v+i));
+	float a[4];
+	_mm_storeu_ps(a, acc);
+	float s=a[0]+a[1]+a[2]+a[3];
+	for(; i<n; i++)
+		s+=v[i];
+	return s;
+}
+
+// rbPredict of every track in one pass
+void batchPredict(FilterBatch &b, ParticlePool &pool, vector<RBFilter*> &filters, double dt)
+{
+	batchSegments(b, pool, filters);
+	int first=b.seg[0], n=b.seg.back()-first;
+	if(n<=0)
+		return;
+	b.noise.resize(2*n);
+	b.gain.resize(n);
+	b.sd.resize(n);
+	Mat noise(1, 2*n, CV_32F, &b.noise[0]);
+	b.rng.fill(noise, RNG::NORMAL, Scalar(0), Scalar(1));
+	for(size_t t=0; t<filters.size(); t++)
+	{
+		RBFilter &f=*filters[t];
+		float Pp=f.P+f.q;
+		float S=(float)(dt*dt)*Pp+f.sigmaPos*f.sigmaPos;
+		float K=Pp*(float)dt/S;
+		std::fill(&b.gain[b.seg[t]-first], &b.gain[b.seg[t+1]-first], K);
+		std::fill(&b.sd[b.seg[t]-first], &b.sd[b.seg[t+1]-first], sqrt(S));
+		f.P=(1.f-K*(float)dt)*Pp;
+	}
+	if(pool.compact)
+	{
+		// positions are relative to the track origin, moving them needs no origin
+		unsigned short *hx=pool.halfField(pool.bank, POOL_X)+first, *hy=pool.halfField(pool.bank, POOL_Y)+first;
+		unsigned short *hvx=pool.halfField(pool.bank, POOL_VX)+first, *hvy=pool.halfField(pool.bank, POOL_VY)+first;
+		if(cpuHasF16C())
+			predictHalfF16C(hx, hy, hvx, hvy, &b.noise[0], &b.noise[n], &b.sd[0], &b.gain[0], (float)dt, n);
+		else
+			predictHalf(hx, hy, hvx, hvy, &b.noise[0], &b.noise[n], &b.sd[0], &b.gain[0], (float)dt, 0, n);
+		return;
+	}
+	float *x=pool.field(pool.bank, POOL_X)+first, *y=pool.field(pool.bank, POOL_Y)+first;
+	float *vx=pool.field(pool.bank, POOL_VX)+first, *vy=pool.field(pool.bank, POOL_VY)+first;
+	const float *ex=&b.noise[0], *ey=&b.noise[n];
+	__m128 vdt=_mm_set1_ps((float)dt);
+	int i=0;
+	for(; i+4<=n; i+=4)
+	{
+		__m128 sd=_mm_loadu_ps(&b.sd[i]), k=_mm_loadu_ps(&b.gain[i]);
+		__m128 dx=_mm_mul_ps(sd, _mm_loadu_ps(ex+i)), dy=_mm_mul_ps(sd, _mm_loadu_ps(ey+i));
+		__m128 vxi=_mm_loadu_ps(vx+i), vyi=_mm_loadu_ps(vy+i);
+		_mm_storeu_ps(x+i, _mm_add_ps(_mm_loadu_ps(x+i), _mm_add_ps(_mm_mul_ps(vxi, vdt), dx)));
+		_mm_storeu_ps(y+i, _mm_add_ps(_mm_loadu_ps(y+i), _mm_add_ps(_mm_mul_ps(vyi, vdt), dy)));
+		_mm_storeu_ps(vx+i, _mm_add_ps(vxi, _mm_mul_ps(k, dx)));
+		_mm_storeu_ps(vy+i, _mm_add_ps(vyi, _mm_mul_ps(k, dy)));
+	}
+	for(; i<n; i++)
+	{
+		float dx=b.sd[i]*ex[i], dy=b.sd[i]*ey[i];
+		x[i]+=vx[i]*(float)dt+dx;
+		y[i]+=vy[i]*(float)dt+dy;
+		vx[i]+=b.gain[i]*dx;
+		vy[i]+=b.gain[i]*dy;
+	}
+}
+
+// multiplies the weights of all tracks by their likelihood on img (or the
+// precomputed likelihoods, from the first particle of the batch), then normalizes each
+// track; neff[t] gets 1/sum w^2 of track t
+void batchWeight(FilterBatch &b, ParticlePool &pool, vector<RBFilter*> &filters, IplImage *img,
+				 const vector<float> *precomputed, vector<float> &neff)
+{
+	batchSegments(b, pool, filters);
+	int first=b.seg[0], n=b.seg.back()-first;
+	neff.assign(filters.size(), 0.f);
+	if(n<=0)
+		return;
+	float *w=pool.field(pool.bank, POOL_W)+first;
+	const float* lik;
+	if(precomputed!=NULL)
+		lik=&(*precomputed)[0];
+	else if(pool.compact)
+	{
+		// absolute positions of each track for the kernel
+		b.px.resize(n);
+		b.py.resize(n);
+		for(size_t t=0; t<filters.size(); t++)
+		{
+			int s=b.seg[t]-first, nt=b.seg[t+1]-b.seg[t];
+			decodeHalf(filters[t]->hx, nt, filters[t]->ox, &b.px[s]);
+			decodeHalf(filters[t]->hy, nt, filters[t]->oy, &b.py[s]);
+		}
+		b.lik.resize(n);
+		likelihoodKernel(img, &b.px[0], &b.py[0], n, &b.lik[0]);
+		lik=&b.lik[0];
+	}
+	else
+	{
+		b.lik.resize(n);
+		likelihoodKernel(img, pool.field(pool.bank, POOL_X)+first, pool.field(pool.bank, POOL_Y)+first, n, &b.lik[0]);
+		lik=&b.lik[0];
+	}
+	int i=0;
+	for(; i+4<=n; i+=4)
+		_mm_storeu_ps(w+i, _mm_mul_ps(_mm_loadu_ps(w+i), _mm_loadu_ps(lik+i)));
+	for(; i<n; i++)
+		w[i]*=lik[i];
+	
+	// segmented normalization: a sum per track, then one scaling pass
+	for(size_t t=0; t<filters.size(); t++)
+	{
+		float* wt=w+b.seg[t]-first;
+		int nt=b.seg[t+1]-b.seg[t];
+		float s=sumSSE(wt, nt);
+		__m128 inv=_mm_set1_ps(s>0.f ? 1.f/s : 0.f), sq=_mm_setzero_ps();
+		int k=0;
+		if(s>0.f)
+		{
+			for(; k+4<=nt; k+=4)
+			{
+				__m128 v=_mm_mul_ps(_mm_loadu_ps(wt+k), inv);
+				_mm_storeu_ps(wt+k, v);
+				sq=_mm_add_ps(sq, _mm_mul_ps(v, v));
+			}
+			float a[4];
+			_mm_storeu_ps(a, sq);
+			float s2=a[0]+a[1]+a[2]+a[3];
+			for(; k<nt; k++)
+			{
+				wt[k]/=s;
+				s2+=wt[k]*wt[k];
+			}
+			neff[t]=1.f/s2;
+		}
+		else
+		{
+			// nothing explains the detection, start over from uniform
+			std::fill(wt, wt+nt, 1.f/nt);
+			neff[t]=(float)nt;
+		}
+	}
+}
+
+// particle positions of whichever filter is running
+int particleCount()
+{
+	return raoBlackwellized ? rbpf.n : cond->SamplesNum;
+}
+
+Point2f particlePosition(int i)
+{
+	if(raoBlackwellized)
+		return Point2f(rbX(rbpf, i), rbY(rbpf, i));
+	return Point2f(cond->flSamples[i][0], cond->flSamples[i][1]);
+}
+
+float particleWeight(int i)
+{
+	return raoBlackwellized ? rbpf.w[i] : cond->flConfidence[i];
+}
+
+// velocity sample (condensation) or velocity mean (rao-blackwellized)
+Point2f particleVelocity(int i)
+{
+	if(raoBlackwellized)
+		return Point2f(rbVX(rbpf, i), rbVY(rbpf, i));
+	return Point2f(cond->flSamples[i][2], cond->flSamples[i][3]);
+}
+
+
+
+//--------track-states--------------------
+// tracking: detector on the roi around the last detection, every frame
+// occluded: occludeMisses misses with a confident filter; coast on the
+//           prediction, probing the predicted roi every probeEvery frames,
+//           lost after lostMisses misses in all (or maxOccluded frames)
+// lost:     rotating scan, one slice of the frame per frame (see reacquireNext)
+// dead:     full frame scan every deadPeriod frames
+// Any detection goes back to tracking.
+
+const char* trackStateName(TrackState s)
+{
+	switch(s)
+	{
+		case TRACK_TRACKING: return "tracking";
+		case TRACK_OCCLUDED: return "occluded";
+		case TRACK_LOST: return "lost";
+		case TRACK_DEAD: return "dead";
+	}
+	return "?";
+}
+
+static void trackEnter(TrackMachine &tm, TrackState s)
+{
+	tm.state=s;
+	tm.stateFrames=0;
+}
+
+// attempted: the detector ran this frame; neff: normalized N_eff of the last
+// weighting. The particles are only weighted on frames with a detection, so
+// after a miss this is the N_eff of the last detection frame
+void trackUpdate(TrackMachine &tm, bool attempted, bool detected, float neff)
+{
+	tm.stateFrames++;
+	if(detected)
+	{
+		tm.misses=0;
+		if(tm.state!=TRACK_TRACKING)
+			trackEnter(tm, TRACK_TRACKING);
+		return;
+	}
+	if(attempted)
+		tm.misses++;
+	switch(tm.state)
+	{
+		case TRACK_TRACKING:
+			// a degenerate cloud cannot coast: lost on the first miss
+			if(attempted && neff<tm.minNeff)
+				trackEnter(tm, TRACK_LOST);
+			else if(tm.misses>=tm.occludeMisses)
+				trackEnter(tm, TRACK_OCCLUDED);
+			break;
+		case TRACK_OCCLUDED:
+			if(tm.misses>=tm.lostMisses || tm.stateFrames>tm.maxOccluded)
+				trackEnter(tm, TRACK_LOST);
+			break;
+		case TRACK_LOST:
+			if(tm.stateFrames>tm.lostFrames)
+				trackEnter(tm, TRACK_DEAD);
+			break;
+		case TRACK_DEAD:
+			break;
+	}
+}
+
+// roi for the next frame and whether the detector runs on it at all
+bool trackPlan(TrackMachine &tm, Point estimate, Size objSize, Size area, Rect &roi)
+{
+	Rect frameRect(Point(0,0), area);
+	switch(tm.state)
+	{
+		case TRACK_TRACKING:
+			return true;
+		case TRACK_OCCLUDED:
+			roi=Rect(estimate.x-objSize.width, estimate.y-objSize.height, objSize.width*2, objSize.height*2) & frameRect;
+			return roi.width>=objSize.width && roi.height>=objSize.height && tm.stateFrames%tm.probeEvery==0;
+		case TRACK_LOST:
+			if(tm.scan.area!=area || tm.scan.objSize!=objSize || (int)tm.scan.slices.size()!=tm.slices)
+				reacquireInit(tm.scan, area, objSize, tm.slices);
+			if(tm.stateFrames==0)
+				reacquireRestart(tm.scan, estimate);
+			roi=reacquireNext(tm.scan);
+			return true;
+		case TRACK_DEAD:
+			roi=frameRect;
+			return tm.stateFrames%tm.deadPeriod==0;
+	}
+	return true;
+}
+
+
+
+//--------frame-memory--------------------
+
+void *arenaAlloc(FrameArena &a, size_t bytes)
+{
+	bytes=(bytes+15)&~(size_t)15;
+	if(a.blocks.empty() || a.used+bytes>a.sizes.back())
+	{
+		// overflow block, folded into one larger block at the next reset
+		size_t sz=MAX(bytes, a.blocks.empty() ? (size_t)1<<20 : a.sizes.back());
+		a.blocks.push_back((char*)fastMalloc(sz));
+		a.sizes.push_back(sz);
+		a.used=0;
+	}
+	void *p=a.blocks.back()+a.used;
+	a.used+=bytes;
+	a.frameBytes+=bytes;
+	return p;
+}
+
+void arenaReset(FrameArena &a)
+{
+	a.peak=MAX(a.peak, a.frameBytes);
+	if(a.blocks.size()>1)
+	{
+		size_t total=0;
+		for(size_t b=0; b<a.blocks.size(); b++)
+		{
+			total+=a.sizes[b];
+			fastFree(a.blocks[b]);
+		}
+		a.blocks.assign(1, (char*)fastMalloc(total));
+		a.sizes.assign(1, total);
+	}
+	a.used=0;
+	a.frameBytes=0;
+}
+
+PoolMatAllocator::~PoolMatAllocator()
+{
+	for(int c=0; c<MATPOOL_CLASSES; c++)
+		for(size_t b=0; b<freeBlocks[c].size(); b++)
+		{
+			if(((int*)freeBlocks[c][b])[2])
+				hugeFree(freeBlocks[c][b], (size_t)4096<<c);
+			else
+				fastFree(freeBlocks[c][b]);
+		}
+}
+
+void PoolMatAllocator::allocate(int dims, const int* sizes, int type, int*& refcount,
+								uchar*& datastart, uchar*& data, size_t* step)
+{
+	size_t total=CV_ELEM_SIZE(type);
+	for(int d=dims-1; d>=0; d--)
+	{
+		step[d]=total;
+		total*=sizes[d];
+	}
+	int c=0;
+	while(c<MATPOOL_CLASSES && ((size_t)4096<<c)<total+MATPOOL_HEADER)
+		c++;
+	uchar *block;
+	if(c<MATPOOL_CLASSES && !freeBlocks[c].empty())
+	{
+		block=freeBlocks[c].back();
+		freeBlocks[c].pop_back();
+		hits++;
+	}
+	else
+	{
+		size_t sz=c<MATPOOL_CLASSES ? (size_t)4096<<c : total+MATPOOL_HEADER;
+		bool huge=hugePages && c<MATPOOL_CLASSES && sz>=HUGE_PAGE;
+		block=huge ? (uchar*)hugeAlloc(sz) : (uchar*)fastMalloc(sz);
+		((int*)block)[2]=huge;
+		misses++;
+		if(c<MATPOOL_CLASSES)
+			bytes+=sz;
+	}
+	refcount=(int*)block;
+	*refcount=1;
+	((int*)block)[1]=c;
+	datastart=data=block+MATPOOL_HEADER;
+}
+
+void PoolMatAllocator::deallocate(int* refcount, uchar* datastart, uchar* data)
+{
+	if(!refcount)
+		return;
+	int c=refcount[1];
+	if(c<MATPOOL_CLASSES)
+		freeBlocks[c].push_back((uchar*)refcount);
+	else
+		fastFree(refcount);
+}
+
+void reportFrameMemory()
+{
+	if(hugePages)
+		cout << "Huge pages: " << (hugeExplicitBytes>>20) << " MB explicit, " << (hugeTransparentBytes>>20)
+			 << " MB transparent (madvise)" << endl;
+	if(!frameArena)
+		return;
+	cout << "Frame arena: peak " << frameArena->peak << " bytes/frame, " << frameArena->blocks.size()
+		 << " block(s)" << endl;
+	cout << "Mat pool: " << matPool->hits << " reused, " << matPool->misses << " allocated, "
+		 << matPool->bytes << " bytes held" << endl;
+}
+
+
+
+//--------huge-pages--------------------
+// Explicit huge pages when the system has them reserved (vm.nr_hugepages),
+// otherwise a 2 MB aligned anonymous mapping advised for transparent huge
+// pages. Sizes are rounded up to whole huge pages, so only large buffers.
+
+static size_t hugeRound(size_t bytes)
+{
+	return (bytes+HUGE_PAGE-1)&~(HUGE_PAGE-1);
+}
+
+// live mappings of hugeAlloc: explicit or not, so hugeFree updates the right count
+static std::map<void*, bool> hugeMappings;
+
+void *hugeAlloc(size_t bytes)
+{
+	size_t len=hugeRound(bytes);
+	void *p=mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if(p!=MAP_FAILED)
+	{
+		hugeExplicitBytes+=len;
+		hugeMappings[p]=true;
+		return p;
+	}
+	// over map and trim to a 2 MB boundary, thp only backs aligned ranges
+	char *raw=(char*)mmap(NULL, len+HUGE_PAGE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(raw==MAP_FAILED)
+		throw std::bad_alloc();
+	char *aligned=(char*)(((size_t)raw+HUGE_PAGE-1)&~(HUGE_PAGE-1));
+	if(aligned>raw)
+		munmap(raw, aligned-raw);
+	munmap(aligned+len, raw+HUGE_PAGE-aligned);
+	madvise(aligned, len, MADV_HUGEPAGE);
+	hugeTransparentBytes+=len;
+	hugeMappings[aligned]=false;
+	return aligned;
+}
+
+void hugeFree(void *p, size_t bytes)
+{
+	size_t len=hugeRound(bytes);
+	std::map<void*, bool>::iterator m=hugeMappings.find(p);
+	if(m!=hugeMappings.end())
+	{
+		(m->second ? hugeExplicitBytes : hugeTransparentBytes)-=len;
+		hugeMappings.erase(m);
+	}
+	munmap(p, len);
+}
+
+// (no)huge page advice for the whole 2 MB pages inside [p, p+bytes) of memory we
+// did not map ourselves (vector storage). Only pages not touched yet are
+// certain to follow it. Returns the bytes advised
+size_t adviseHugePages(void *p, size_t bytes, bool huge)
+{
+	size_t begin=((size_t)p+HUGE_PAGE-1)&~(HUGE_PAGE-1);
+	size_t end=((size_t)p+bytes)&~(HUGE_PAGE-1);
+	if(end<=begin || madvise((void*)begin, end-begin, huge ? MADV_HUGEPAGE : MADV_NOHUGEPAGE)!=0)
+		return 0;
+	return end-begin;
+}
+
+void HugeBuffer::reserve(size_t n)
+{
+	if(n<=bytes)
+		return;
+	if(p)
+		hugeFree(p, bytes);
+	bytes=hugeRound(n);
+	p=hugeAlloc(bytes);
+}
+
+int dtlbCounterOpen()
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size=sizeof(attr);
+	attr.type=PERF_TYPE_HW_CACHE;
+	attr.config=PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ<<8) | (PERF_COUNT_HW_CACHE_RESULT_MISS<<16);
+	attr.disabled=1;
+	attr.exclude_kernel=1;
+	attr.exclude_hv=1;
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// counts from now on, returns what was counted since the last call
+long long dtlbCounterRead(int fd)
+{
+	long long count=-1;
+	if(fd<0)
+		return -1;
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	if(read(fd, &count, sizeof(count))!=sizeof(count))
+		count=-1;
+	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	return count;
+}
+
+
+
+//--------numa--------------------
+// Topology and counters from sysfs, no libnuma. Placement is first touch: the
+// pools, arena and pyramid buffers are written first by the pinned threads.
+
+int numaNodeCount()
+{
+	int n=0;
+	char name[64];
+	for(;;)
+	{
+		sprintf(name, "/sys/devices/system/node/node%d", n);
+		if(access(name, F_OK)!=0)
+			return n;
+		n++;
+	}
+}
+
+// cpulist is e.g. "0-7,16-23"
+static bool numaNodeCpus(int node, cpu_set_t &set)
+{
+	char name[64];
+	sprintf(name, "/sys/devices/system/node/node%d/cpulist", node);
+	ifstream in(name);
+	string list;
+	if(!getline(in, list))
+		return false;
+	CPU_ZERO(&set);
+	int count=0;
+	stringstream ss(list);
+	string range;
+	while(getline(ss, range, ','))
+	{
+		int a, b;
+		int fields=sscanf(range.c_str(), "%d-%d", &a, &b);
+		if(fields<1)
+			continue;
+		if(fields==1)
+			b=a;
+		for(int c=a; c<=b && c<CPU_SETSIZE; c++, count++)
+			CPU_SET(c, &set);
+	}
+	return count>0;
+}
+
+bool numaPin(int node)
+{
+	cpu_set_t set;
+	if(!numaNodeCpus(node, set))
+		return false;
+	return sched_setaffinity(0, sizeof(set), &set)==0;
+}
+
+bool numaReadStat(int node, NumaStat &st)
+{
+	char name[64];
+	sprintf(name, "/sys/devices/system/node/node%d/numastat", node);
+	ifstream in(name);
+	if(!in)
+		return false;
+	st.numaHit=st.numaMiss=st.otherNode=0;
+	string key;
+	long value;
+	while(in >> key >> value)
+	{
+		if(key=="numa_hit")
+			st.numaHit=value;
+		else if(key=="numa_miss")
+			st.numaMiss=value;
+		else if(key=="other_node")
+			st.otherNode=value;
+	}
+	return true;
+}
+
+// resident memory of this process per node (KiB), from the N<node>=<pages> fields
+void numaProcessPages(vector<long> &kbPerNode)
+{
+	kbPerNode.assign(MAX(numaNodeCount(), 1), 0);
+	ifstream in("/proc/self/numa_maps");
+	string line;
+	while(getline(in, line))
+	{
+		long pageKb=4;
+		size_t k=line.find("kernelpagesize_kB=");
+		if(k!=string::npos)
+			pageKb=atol(line.c_str()+k+18);
+		stringstream ss(line);
+		string field;
+		while(ss >> field)
+		{
+			int node;
+			long pages;
+			if(field[0]=='N' && sscanf(field.c_str(), "N%d=%ld", &node, &pages)==2 && node<(int)kbPerNode.size())
+				kbPerNode[node]+=pages*pageKb;
+		}
+	}
+}
+
+// local and remote memory of the process, and the allocations of the node that
+// had to go elsewhere while we ran. Appended to results_numa.csv
+void reportNuma(const NumaStat &start)
+{
+	if(numaNode<0)
+		return;
+	vector<long> kb;
+	numaProcessPages(kb);
+	long local=0, remote=0;
+	for(size_t n=0; n<kb.size(); n++)
+		(n==(size_t)numaNode ? local : remote)+=kb[n];
+	NumaStat end;
+	if(!numaReadStat(numaNode, end))
+		end=start;
+	cout << "Numa node " << numaNode << ": " << local << " KiB local, " << remote << " KiB remote, node numa_miss +"
+		 << end.numaMiss-start.numaMiss << ", other_node +" << end.otherNode-start.otherNode << endl;
+	FILE* out=fopen("results_numa.csv","a");
+	if(out!=NULL)
+	{
+		fprintf(out, "%d,%ld,%ld,%ld,%ld,%ld\n", numaNode, local, remote, end.numaHit-start.numaHit,
+				end.numaMiss-start.numaMiss, end.otherNode-start.otherNode);
+		fclose(out);
+	}
+}
+
+
+
+//--------mode-extraction--------------------
+// The weighted mean of a bimodal cloud lies between the modes. Particles are
+// binned in a hash grid (one pass), every bin points to its heaviest 3x3
+// neighbour and the chains end in local maxima: each maximum and the bins
+// leading to it form a mode. Linear in the particles; only the top modes are
+// sorted.
+
+struct ModeBin
+{
+	int cx, cy;
+	double w, sx, sy, sxx, syy;
+	int parent;
+};
+
+static inline unsigned int modeHash(int cx, int cy)
+{
+	return (unsigned int)cx*73856093u ^ (unsigned int)cy*19349663u;
+}
+
+static int modeLookup(const FrameVector<int>::type &table, const FrameVector<ModeBin>::type &bins, int cx, int cy)
+{
+	unsigned int mask=(unsigned int)table.size()-1;
+	for(unsigned int h=modeHash(cx, cy)&mask; ; h=(h+1)&mask)
+	{
+		int b=table[h];
+		if(b<0)
+			return -1;
+		if(bins[b].cx==cx && bins[b].cy==cy)
+			return b;
+	}
+}
+
+static bool heavierMode(const ParticleMode &a, const ParticleMode &b)
+{
+	return a.mass>b.mass;
+}
+
+// up to maxModes modes by decreasing mass (share of the total weight); uniform
+// weights if !weighted. Returns the number of modes found before the cut
+int extractModes(float cell, int maxModes, bool weighted, vector<ParticleMode> &modes)
+{
+	int n=particleCount();
+	modes.clear();
+	unsigned int size=16;
+	while(size<2u*(unsigned int)n)
+		size<<=1;
+	FrameVector<int>::type table(size, -1);
+	FrameVector<ModeBin>::type bins;
+	double total=0.0;
+	for(int i=0; i<n; i++)
+	{
+		double wi=weighted ? particleWeight(i) : 1.0;
+		if(!(wi>0.0))
+			continue;
+		Point2f p=particlePosition(i);
+		int cx=cvFloor(p.x/cell), cy=cvFloor(p.y/cell);
+		unsigned int h=modeHash(cx, cy)&(size-1);
+		while(table[h]>=0 && (bins[table[h]].cx!=cx || bins[table[h]].cy!=cy))
+			h=(h+1)&(size-1);
+		if(table[h]<0)
+		{
+			ModeBin nb={cx, cy, 0, 0, 0, 0, 0, -1};
+			table[h]=(int)bins.size();
+			bins.push_back(nb);
+		}
+		ModeBin &b=bins[table[h]];
+		b.w+=wi;
+		b.sx+=wi*p.x;
+		b.sy+=wi*p.y;
+		b.sxx+=wi*p.x*p.x;
+		b.syy+=wi*p.y*p.y;
+		total+=wi;
+	}
+	if(bins.empty())
+		return 0;
+	
+	// local merging: parent is the heaviest bin of the 3x3 neighbourhood
+	for(size_t b=0; b<bins.size(); b++)
+	{
+		int best=(int)b;
+		for(int dy=-1; dy<=1; dy++)
+			for(int dx=-1; dx<=1; dx++)
+			{
+				int nb=modeLookup(table, bins, bins[b].cx+dx, bins[b].cy+dy);
+				if(nb>=0 && bins[nb].w>bins[best].w)
+					best=nb;
+			}
+		bins[b].parent=best;
+	}
+	FrameVector<int>::type modeOf(bins.size(), -1);
+	FrameVector<ModeBin>::type acc;
+	for(size_t b=0; b<bins.size(); b++)
+	{
+		int r=(int)b;
+		while(bins[r].parent!=r)
+			r=bins[r].parent;
+		// path compression: every bin of the chain points at the root, so no
+		// chain is walked twice
+		for(int c=(int)b; c!=r; )
+		{
+			int next=bins[c].parent;
+			bins[c].parent=r;
+			c=next;
+		}
+		if(modeOf[r]<0)
+		{
+			ModeBin m={0, 0, 0, 0, 0, 0, 0, r};
+			modeOf[r]=(int)acc.size();
+			acc.push_back(m);
+		}
+		ModeBin &m=acc[modeOf[r]];
+		m.w+=bins[b].w;
+		m.sx+=bins[b].sx;
+		m.sy+=bins[b].sy;
+		m.sxx+=bins[b].sxx;
+		m.syy+=bins[b].syy;
+	}
+	for(size_t k=0; k<acc.size(); k++)
+	{
+		ParticleMode pm;
+		pm.center=Point2f((float)(acc[k].sx/acc[k].w), (float)(acc[k].sy/acc[k].w));
+		pm.spread=Point2f((float)sqrt(MAX(acc[k].sxx/acc[k].w-pm.center.x*pm.center.x, 0.0)),
+						  (float)sqrt(MAX(acc[k].syy/acc[k].w-pm.center.y*pm.center.y, 0.0)));
+		pm.mass=(float)(acc[k].w/total);
+		modes.push_back(pm);
+	}
+	int found=(int)modes.size();
+	int keep=MIN(maxModes, found);
+	std::partial_sort(modes.begin(), modes.begin()+keep, modes.end(), heavierMode);
+	modes.resize(keep);
+	return found;
+}
+
+
+
+//--------reacquisition--------------------
+// A full frame detectMultiScale on every frame while the target is lost makes
+// the lost frames the slowest ones. Scanning one of K slices per frame costs
+// about 1/K of it; the target is found at most K frames late, sooner when it
+// is near where it was lost, since every round starts from the nearest slice.
+
+// slices overlap by a window so no object falls between two of them. A rebuild
+// (new frame or object size) keeps the anchor, the frame centre until the first
+// reacquireRestart
+void reacquireInit(ReacquireScan &rs, Size area, Size objSize, int k)
+{
+	if(rs.slices.empty())
+		rs.anchor=Point(area.width/2, area.height/2);
+	rs.area=area;
+	rs.objSize=objSize;
+	rs.slices.clear();
+	Rect frameRect(Point(0,0), area);
+	int width=(area.width+k-1)/k;
+	for(int i=0; i<k; i++)
+		rs.slices.push_back(Rect(i*width-objSize.width/2, 0, width+objSize.width, area.height) & frameRect);
+	rs.order.clear();
+	rs.next=0;
+}
+
+// next round starts from the slice nearest to anchor
+void reacquireRestart(ReacquireScan &rs, Point anchor)
+{
+	rs.anchor=anchor;
+	rs.next=0;
+}
+
+Rect reacquireNext(ReacquireScan &rs)
+{
+	int k=(int)rs.slices.size();
+	if(rs.next==0)
+	{
+		// slices by distance of their centre from the anchor (insertion sort, k is small)
+		rs.order.resize(k);
+		for(int i=0; i<k; i++)
+		{
+			int j=i, d=abs(rs.slices[i].x+rs.slices[i].width/2-rs.anchor.x);
+			while(j>0 && abs(rs.slices[rs.order[j-1]].x+rs.slices[rs.order[j-1]].width/2-rs.anchor.x)>d)
+			{
+				rs.order[j]=rs.order[j-1];
+				j--;
+			}
+			rs.order[j]=i;
+		}
+	}
+	Rect r=rs.slices[rs.order[rs.next]];
+	rs.next=(rs.next+1)%k;
+	return r;
+}
+
+
+
+//--------offline-smoothing--------------------
+// Offline the estimate of a frame may use the frames after it. The forward
+// filter stores a gaussian summary (mean, covariance) of each posterior and a
+// Rauch-Tung-Striebel pass runs backwards over them with the constant velocity
+// model of the filter. Gaps between detector runs are bridged by the smoother,
+// so the detector only runs every --offline N frames while the target is found.
+
+typedef double Mat44[16];
+
+static void mul44(const double* a, const double* b, double* c)
+{
+	for(int r=0; r<4; r++)
+		for(int k=0; k<4; k++)
+		{
+			double s=0.0;
+			for(int j=0; j<4; j++)
+				s+=a[r*4+j]*b[j*4+k];
+			c[r*4+k]=s;
+		}
+}
+
+static void transpose44(const double* a, double* t)
+{
+	for(int r=0; r<4; r++)
+		for(int k=0; k<4; k++)
+			t[k*4+r]=a[r*4+k];
+}
+
+// gauss-jordan with partial pivoting, a is a covariance so it is invertible
+// unless the filter collapsed; false then
+static bool invert44(const double* a, double* inv)
+{
+	double m[4][8];
+	for(int r=0; r<4; r++)
+		for(int k=0; k<4; k++)
+		{
+			m[r][k]=a[r*4+k];
+			m[r][k+4]=r==k ? 1.0 : 0.0;
+		}
+	for(int c=0; c<4; c++)
+	{
+		int p=c;
+		for(int r=c+1; r<4; r++)
+			if(fabs(m[r][c])>fabs(m[p][c]))
+				p=r;
+		if(fabs(m[p][c])<1e-12)
+			return false;
+		for(int k=0; k<8; k++)
+			std::swap(m[c][k], m[p][k]);
+		double d=1.0/m[c][c];
+		for(int k=0; k<8; k++)
+			m[c][k]*=d;
+		for(int r=0; r<4; r++)
+			if(r!=c)
+			{
+				double f=m[r][c];
+				for(int k=0; k<8; k++)
+					m[r][k]-=f*m[c][k];
+			}
+	}
+	for(int r=0; r<4; r++)
+		for(int k=0; k<4; k++)
+			inv[r*4+k]=m[r][k+4];
+	return true;
+}
+
+// constant velocity transition over dt and the process noise the running
+// filter adds per frame (uniform RandS ranges or the rao-blackwellized gaussians)
+static void motionModel(double dt, double* F, double* Q)
+{
+	for(int k=0; k<16; k++)
+		F[k]=Q[k]=0.0;
+	for(int k=0; k<4; k++)
+		F[k*4+k]=1.0;
+	F[0*4+2]=dt;
+	F[1*4+3]=dt;
+	double pos, vel;
+	if(raoBlackwellized)
+	{
+		pos=rbpf.sigmaPos*rbpf.sigmaPos;
+		vel=rbpf.q;
+	}
+	else
+	{
+		// variance of uniform(-a,a) is a^2/3
+		double a=pfPosNoise(), b=pfVelNoise();
+		pos=a*a/3.0;
+		vel=b*b/3.0;
+	}
+	Q[0]=Q[5]=pos;
+	Q[10]=Q[15]=vel;
+}
+
+// weighted mean and covariance of the particles (uniform weights if !weighted);
+// the rao-blackwellized velocity variance P adds to the velocity block
+void summarizeFilter(FrameSummary &fs, bool weighted)
+{
+	int n=particleCount();
+	double sw=0.0;
+	for(int k=0; k<4; k++)
+		fs.m[k]=0.0;
+	for(int k=0; k<16; k++)
+		fs.P[k]=0.0;
+	for(int i=0; i<n; i++)
+	{
+		double wi=weighted ? particleWeight(i) : 1.0;
+		Point2f p=particlePosition(i), v=particleVelocity(i);
+		fs.m[0]+=wi*p.x;
+		fs.m[1]+=wi*p.y;
+		fs.m[2]+=wi*v.x;
+		fs.m[3]+=wi*v.y;
+		sw+=wi;
+	}
+	if(!(sw>0.0))
+	{
+		summarizeFilter(fs, false);
+		return;
+	}
+	for(int k=0; k<4; k++)
+		fs.m[k]/=sw;
+	for(int i=0; i<n; i++)
+	{
+		double wi=(weighted ? particleWeight(i) : 1.0)/sw;
+		Point2f p=particlePosition(i), v=particleVelocity(i);
+		double d[4]={p.x-fs.m[0], p.y-fs.m[1], v.x-fs.m[2], v.y-fs.m[3]};
+		for(int r=0; r<4; r++)
+			for(int k=0; k<4; k++)
+				fs.P[r*4+k]+=wi*d[r]*d[k];
+	}
+	if(raoBlackwellized)
+	{
+		fs.P[10]+=rbpf.P;
+		fs.P[15]+=rbpf.P;
+	}
+}
+
+// RTS: m_t += G (m_t+1 - F m_t), P_t += G (P_t+1 - F P_t F' - Q) G'
+// with G = P_t F' (F P_t F' + Q)^-1, from the last frame back
+void smoothTrack(vector<FrameSummary> &track)
+{
+	for(int t=(int)track.size()-2; t>=0; t--)
+	{
+		FrameSummary &cur=track[t];
+		const FrameSummary &next=track[t+1];
+		Mat44 F, Q, Ft, FP, Pp, PFt, PpInv, G, Gt, tmp, dP;
+		motionModel(next.dt, F, Q);
+		transpose44(F, Ft);
+		mul44(F, cur.P, FP);
+		mul44(FP, Ft, Pp);
+		for(int k=0; k<16; k++)
+			Pp[k]+=Q[k];
+		if(!invert44(Pp, PpInv))
+			continue;
+		mul44(cur.P, Ft, PFt);
+		mul44(PFt, PpInv, G);
+		transpose44(G, Gt);
+		
+		double mp[4], dm[4];
+		for(int r=0; r<4; r++)
+		{
+			mp[r]=0.0;
+			for(int k=0; k<4; k++)
+				mp[r]+=F[r*4+k]*cur.m[k];
+			dm[r]=next.m[r]-mp[r];
+		}
+		for(int r=0; r<4; r++)
+			for(int k=0; k<4; k++)
+				cur.m[r]+=G[r*4+k]*dm[k];
+		for(int k=0; k<16; k++)
+			dP[k]=next.P[k]-Pp[k];
+		mul44(G, dP, tmp);
+		mul44(tmp, Gt, dP);
+		for(int k=0; k<16; k++)
+			cur.P[k]+=dP[k];
+	}
+}
+
+// frame, smoothed x, y, position std devs, whether the detector saw that frame
+void writeSmoothedTrack(const vector<FrameSummary> &track, const char* filename)
+{
+	FILE* out=fopen(filename, "w");
+	if(out==NULL)
+		return;
+	for(size_t t=0; t<track.size(); t++)
+		fprintf(out, "%d,%f,%f,%f,%f,%d\n", track[t].frame, track[t].m[0], track[t].m[1],
+				sqrt(MAX(track[t].P[0], 0.0)), sqrt(MAX(track[t].P[5], 0.0)), track[t].detected);
+	fclose(out);
+	cout << "Smoothed track of " << track.size() << " frames written to " << filename << endl;
+}
+
+
+
+//--------particle-grid--------------------
+// Most particles are far from the detection, where the likelihood is the
+// constant floor. Binning them once per frame in cells of twice the likelihood
+// support lets the weighting evaluate only the (at most 4) cells around it.
+
+void buildParticleGrid(ParticleGrid &g, Size area, int cell)
+{
+	int n=particleCount();
+	g.cell=cell;
+	g.cols=(area.width+cell-1)/cell;
+	g.rows=(area.height+cell-1)/cell;
+	g.start.assign(g.cols*g.rows+1, 0);
+	g.index.resize(n);
+	vector<int> cellOf(n);
+	for(int i=0; i<n; i++)
+	{
+		Point2f p=particlePosition(i);
+		// truncated like the weighting loops, (-1,0) is still column 0
+		int cx=(int)p.x/cell, cy=(int)p.y/cell;
+		if((int)p.x<0 || (int)p.y<0 || (int)p.x>=area.width || (int)p.y>=area.height)
+		{
+			cellOf[i]=-1;
+			continue;
+		}
+		cellOf[i]=cy*g.cols+cx;
+		g.start[cellOf[i]+1]++;
+	}
+	for(int c=0; c<g.cols*g.rows; c++)
+		g.start[c+1]+=g.start[c];
+	vector<int> fill(g.start.begin(), g.start.end()-1);
+	for(int i=0; i<n; i++)
+		if(cellOf[i]>=0)
+			g.index[fill[cellOf[i]]++]=i;
+}
+
+// likelihood of every particle for a detection at center: 0 outside the frame
+// (as the weighting loops do), the floor in bulk, calc_likelihood in the cells
+// within LIKELIHOOD_SUPPORT of center. Returns the number of evaluations
+long gridLikelihood(const ParticleGrid &g, IplImage *img, Point center, vector<float> &lik)
+{
+	int n=particleCount();
+	float floor=likelihood_floor();
+	lik.assign(n, 0.f);
+	for(int c=0; c<g.cols*g.rows; c++)
+		for(int k=g.start[c]; k<g.start[c+1]; k++)
+			lik[g.index[k]]=floor;
+	
+	int cx0=MAX(0, (center.x-LIKELIHOOD_SUPPORT)/g.cell), cx1=MIN(g.cols-1, (center.x+LIKELIHOOD_SUPPORT)/g.cell);
+	int cy0=MAX(0, (center.y-LIKELIHOOD_SUPPORT)/g.cell), cy1=MIN(g.rows-1, (center.y+LIKELIHOOD_SUPPORT)/g.cell);
+	vector<int> near;
+	for(int cy=cy0; cy<=cy1; cy++)
+		for(int cx=cx0; cx<=cx1; cx++)
+		{
+			int c=cy*g.cols+cx;
+			near.insert(near.end(), g.index.begin()+g.start[c], g.index.begin()+g.start[c+1]);
+		}
+	int m=(int)near.size();
+	vector<float> x(m), y(m), l(m);
+	for(int k=0; k<m; k++)
+	{
+		Point2f p=particlePosition(near[k]);
+		x[k]=p.x;
+		y[k]=p.y;
+	}
+	if(m>0)
+		likelihoodKernel(img, &x[0], &y[0], m, &l[0]);
+	for(int k=0; k<m; k++)
+		lik[near[k]]=l[k];
+	return m;
+}
+
+// likelihood of every particle, 0 outside the frame
+void particleLikelihoods(IplImage *img, vector<float> &lik)
+{
+	int n=particleCount();
+	vector<float> x(n), y(n);
+	for(int i=0; i<n; i++)
+	{
+		Point2f p=particlePosition(i);
+		x[i]=p.x;
+		y[i]=p.y;
+	}
+	lik.resize(n);
+	if(n>0)
+		likelihoodKernel(img, &x[0], &y[0], n, &lik[0]);
+}
+
+
+
+//--------fast-math--------------------
+// SSE exp for the particle likelihood kernel: the usual range reduction
+// (x = n*ln2 + r) and a short series, the degree of the polynomial sets the
+// accuracy. --mathcheck prints the error against libm for every degree.
+
+template<int D> struct ExpPoly
+{
+	// 1 + r + r^2/2! + ... + r^D/D! by horner, c is 1/k! for the current k
+	static inline __m128 eval(__m128 r, float c, int k)
+	{
+		return _mm_add_ps(_mm_set1_ps(c), _mm_mul_ps(r, ExpPoly<D-1>::eval(r, c/(k+1), k+1)));
+	}
+};
+
+template<> struct ExpPoly<0>
+{
+	static inline __m128 eval(__m128, float c, int) { return _mm_set1_ps(c); }
+};
+
+template<int D>
+static inline __m128 exp_ps(__m128 x)
+{
+	x=_mm_max_ps(_mm_min_ps(x, _mm_set1_ps(88.3762626647949f)), _mm_set1_ps(-87.3365447505531f));
+	__m128i n=_mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)));
+	__m128 fn=_mm_cvtepi32_ps(n);
+	// ln2 in two parts so r keeps full precision
+	__m128 r=_mm_sub_ps(x, _mm_mul_ps(fn, _mm_set1_ps(0.693359375f)));
+	r=_mm_add_ps(r, _mm_mul_ps(fn, _mm_set1_ps(2.12194440e-4f)));
+	__m128 p=ExpPoly<D>::eval(r, 1.f, 0);
+	__m128i e=_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23);
+	return _mm_mul_ps(p, _mm_castsi128_ps(e));
+}
+
+// calc_likelihood of 4 particles per step. The distance is squared again right
+// away, so no sqrt: log L = log(1/(sqrt(2 pi) sigma)) - d^2/(2 sigma^2)
+template<int D>
+static void likelihoodKernelSSE(IplImage *img, const float *x, const float *y, int n, float *lik)
+{
+	const float sigma=50.f;
+	const __m128 logNorm=_mm_set1_ps((float)log(1.0/(sqrt(2.0*CV_PI)*sigma)));
+	const __m128 k=_mm_set1_ps(-1.f/(2.f*sigma*sigma));
+	for(int i=0; i<n; i+=4)
+	{
+		float d2[4], inside[4];
+		for(int j=0; j<4; j++)
+		{
+			d2[j]=0.f;
+			inside[j]=0.f;
+			if(i+j>=n)
+				continue;
+			int xx=(int)x[i+j], yy=(int)y[i+j];
+			if(xx<0 || yy<0 || xx>=img->width || yy>=img->height)
+				continue;
+			const char* p=img->imageData+img->widthStep*yy+xx*3;
+			float b=p[0], g=p[1], r=255.f-p[2];
+			d2[j]=b*b+g*g+r*r;
+			inside[j]=1.f;
+		}
+		__m128 l=exp_ps<D>(_mm_add_ps(logNorm, _mm_mul_ps(k, _mm_loadu_ps(d2))));
+		l=_mm_mul_ps(l, _mm_loadu_ps(inside));
+		float out[4];
+		_mm_storeu_ps(out, l);
+		for(int j=0; j<4 && i+j<n; j++)
+			lik[i+j]=out[j];
+	}
+}
+
+// all particle likelihoods go through here: libm calc_likelihood unless
+// --fastmath picked a polynomial degree
+void likelihoodKernel(IplImage *img, const float *x, const float *y, int n, float *lik)
+{
+	switch(fastExpDegree)
+	{
+		case 3: likelihoodKernelSSE<3>(img, x, y, n, lik); return;
+		case 4: likelihoodKernelSSE<4>(img, x, y, n, lik); return;
+		case 5: likelihoodKernelSSE<5>(img, x, y, n, lik); return;
+		case 6: likelihoodKernelSSE<6>(img, x, y, n, lik); return;
+	}
+	for(int i=0; i<n; i++)
+	{
+		int xx=(int)x[i], yy=(int)y[i];
+		if(xx<0 || yy<0 || xx>=img->width || yy>=img->height)
+			lik[i]=0.f;
+		else
+			lik[i]=calc_likelihood(img, xx, yy);
+	}
+}
+
+template<int D>
+static double expMaxRelError(const vector<float> &v)
+{
+	double e=0.0;
+	for(size_t i=0; i+4<=v.size(); i+=4)
+	{
+		float out[4];
+		_mm_storeu_ps(out, exp_ps<D>(_mm_loadu_ps(&v[i])));
+		for(int j=0; j<4; j++)
+		{
+			double ref=exp((double)v[i+j]);
+			e=MAX(e, fabs(out[j]-ref)/ref);
+		}
+	}
+	return e;
+}
+
+// documented max relative errors by degree (3..6): exp against libm, and the
+// likelihood kernel against calc_likelihood, where the float rounding of the
+// exp argument (up to about 40) adds a few 1e-6
+static const double expErrorBound[7]={0, 0, 0, 1e-3, 1e-4, 5e-6, 5e-7};
+static const double kernelErrorBound[7]={0, 0, 0, 1e-3, 1e-4, 1e-5, 1e-5};
+
+// max error of every degree against libm (double) on the ranges the kernels
+// see, and of the likelihood kernel against calc_likelihood on a synthetic image.
+// False if the chosen degree (every degree without --fastmath) exceeds its bound
+bool validateFastMath()
+{
+	bool ok=true;
+	double expError[7];
+	const int n=1<<16;
+	vector<float> ex(n);
+	for(int i=0; i<n; i++)
+		ex[i]=-87.f+87.f*i/(n-1);	// exp arguments of likelihoods
+	expError[3]=expMaxRelError<3>(ex);
+	expError[4]=expMaxRelError<4>(ex);
+	expError[5]=expMaxRelError<5>(ex);
+	expError[6]=expMaxRelError<6>(ex);
+	for(int d=3; d<=6; d++)
+	{
+		bool pass=expError[d]<=expErrorBound[d];
+		cout << "exp degree " << d << " max relative error on [-87,0]: " << expError[d]
+			 << " (bound " << expErrorBound[d] << ")" << (pass ? "" : " FAILED") << endl;
+		if(!pass && (fastExpDegree==0 || fastExpDegree==d))
+			ok=false;
+	}
+	// every reachable pixel of the likelihood image: a blurred disc as in main
+	IplImage *img=cvCreateImage(cvSize(200,200),IPL_DEPTH_8U,3);
+	cvZero(img);
+	cvCircle(img, cvPoint(100,100), 20, CV_RGB(100,0,0), -1,8,0);
+	cvSmooth(img, img, CV_GAUSSIAN, 27);
+	vector<float> x, y;
+	for(int yy=0; yy<200; yy++)
+		for(int xx=0; xx<200; xx++)
+		{
+			x.push_back(xx+0.5f);
+			y.push_back(yy+0.5f);
+		}
+	vector<float> lik(x.size());
+	int saved=fastExpDegree;
+	for(int d=3; d<=6; d++)
+	{
+		fastExpDegree=d;
+		likelihoodKernel(img, &x[0], &y[0], (int)x.size(), &lik[0]);
+		double e=0.0;
+		for(size_t i=0; i<x.size(); i++)
+		{
+			double r=calc_likelihood(img, (int)x[i], (int)y[i]);
+			e=MAX(e, fabs(lik[i]-r)/r);
+		}
+		bool pass=e<=kernelErrorBound[d];
+		cout << "likelihood kernel degree " << d << " max relative error: " << e
+			 << " (bound " << kernelErrorBound[d] << ")" << (pass ? "" : " FAILED") << endl;
+		if(!pass && (saved==0 || saved==d))
+			ok=false;
+	}
+	fastExpDegree=saved;
+	cvReleaseImage(&img);
+	return ok;
+}
+
+
+
+//--------mean-shift--------------------
+// The weighted mean sits between the modes when the weights are multimodal
+// (two detections, a false positive); mean shift with a gaussian kernel climbs
+// from a start inside one of them (the heaviest particle) to its mode of the
+// weighted particle density.
+
+Point2f meanShiftMode(Point2f start, float bandwidth, int maxIter)
+{
+	Point2f m=start;
+	float inv2h2=1.f/(2.f*bandwidth*bandwidth);
+	// beyond 3 bandwidths the kernel is below 1.2e-2, skip the exp
+	float cut2=9.f*bandwidth*bandwidth;
+	int n=particleCount();
+	for(int it=0; it<maxIter; it++)
+	{
+		double sx=0.0, sy=0.0, sw=0.0;
+		for(int i=0; i<n; i++)
+		{
+			Point2f p=particlePosition(i);
+			float dx=p.x-m.x, dy=p.y-m.y, d2=dx*dx+dy*dy;
+			if(d2>cut2)
+				continue;
+			double k=particleWeight(i)*exp(-d2*inv2h2);
+			sx+=k*p.x;
+			sy+=k*p.y;
+			sw+=k;
+		}
+		if(!(sw>0.0))
+			break;
+		Point2f next((float)(sx/sw), (float)(sy/sw));
+		float shift=fabs(next.x-m.x)+fabs(next.y-m.y);
+		m=next;
+		if(shift<0.5f)
+			break;
+	}
+	return m;
+}
+
+
+
+//--------live-capture--------------------
+
+// camera indices and network streams are live, anything else is a file
+bool isLiveSource(const char* source)
+{
+	if(strstr(source,"://")!=NULL)
+		return true;
+	for(const char* c=source; *c; c++)
+		if(!isdigit(*c))
+			return false;
+	return *source!=0;
+}
+
+// strips the "--option" switches from argv so positional arguments keep their index
+void parseOptions(int &argc, char **argv)
+{
+	int k=1;
+	for(int i=1;i<argc;i++)
+	{
+		if(strcmp(argv[i],"--live")==0)
+			liveMode=true;
+		else if(strcmp(argv[i],"--gray")==0)
+			grayDetection=true;
+		else if(strcmp(argv[i],"--evaltrain")==0)
+			evalTrainset=true;
+		else if(strcmp(argv[i],"--lut")==0)
+			lutGradient=true;
+		else if(strcmp(argv[i],"--sparse")==0)
+			sparseScoring=true;
+		else if(strcmp(argv[i],"--coarse")==0)
+			coarseToFine=true;
+		else if(strcmp(argv[i],"--compiled")==0)
+			compiledScoring=true;
+		else if(strcmp(argv[i],"--dupcache")==0)
+			dupCache=true;
+		else if(strcmp(argv[i],"--regularized")==0)
+			regularizedPF=true;
+		else if(strcmp(argv[i],"--rb")==0)
+			raoBlackwellized=true;
+		else if(strcmp(argv[i],"--states")==0)
+			trackStates=true;
+		else if(strcmp(argv[i],"--numa")==0 && i+1<argc)
+			numaNode=atoi(argv[++i]);
+		else if(strcmp(argv[i],"--hugepages")==0)
+			hugePages=true;
+		else if(strcmp(argv[i],"--arena")==0)
+		{
+			static FrameArena arena;
+			static PoolMatAllocator pool;
+			frameArena=&arena;
+			matPool=&pool;
+		}
+		else if(strcmp(argv[i],"--modes")==0 && i+1<argc)
+			multiModes=MAX(1, atoi(argv[++i]));
+		else if(strcmp(argv[i],"--reacquire")==0 && i+1<argc)
+			reacquireSlices=MAX(1, atoi(argv[++i]));
+		else if(strcmp(argv[i],"--offline")==0 && i+1<argc)
+			offlineDetectEvery=MAX(1, atoi(argv[++i]));
+		else if(strcmp(argv[i],"--half")==0)
+		{
+			// float16 particles are only read and written by the batched passes
+			compactParticles=true;
+			batchedFilters=true;
+			raoBlackwellized=true;
+		}
+		else if(strcmp(argv[i],"--batched")==0)
+		{
+			batchedFilters=true;
+			raoBlackwellized=true;
+		}
+		else if(strcmp(argv[i],"--budget")==0 && i+1<argc)
+		{
+			// only the rao-blackwellized filter lives in the pool
+			particleBudget=atoi(argv[++i]);
+			raoBlackwellized=true;
+		}
+		else if(strcmp(argv[i],"--meanshift")==0)
+			meanShiftEstimate=true;
+		else if(strcmp(argv[i],"--grid")==0)
+			gridCulling=true;
+		else if(strcmp(argv[i],"--fastmath")==0 && i+1<argc)
+			fastExpDegree=MAX(3, MIN(6, atoi(argv[++i])));
+		else if(strcmp(argv[i],"--mathcheck")==0)
+			mathCheck=true;
+		else if(strcmp(argv[i],"--shape")==0 && i+1<argc)
+			shapeSpecs.push_back(argv[++i]);
+		else
+			argv[k++]=argv[i];
+	}
+	argc=k;
+	// after all options, so the check knows the --fastmath degree
+	if(mathCheck && !validateFastMath())
+	{
+		cout << "fast math error above the bound" << endl;
+		exit(1);
+	}
+}
+
+static double msNow()
+{
+	return (double)getTickCount()*1000./getTickFrequency();
+}
+
+static void* liveCaptureLoop(void* arg)
+{
+	LiveCapture &lc=*(LiveCapture*)arg;
+	while(1)
+	{
+		Mat f; // new buffer every time, the tracker may still hold the previous one
+		lc.cap >> f;
+		double stamp=msNow();
+		
+		pthread_mutex_lock(&lc.lock);
+		if(!lc.running || !f.data)
+		{
+			lc.running=false;
+			pthread_cond_signal(&lc.ready);
+			pthread_mutex_unlock(&lc.lock);
+			break;
+		}
+		if(lc.fresh)
+			lc.dropped++;
+		lc.newest=f;
+		lc.newestStamp=stamp;
+		lc.fresh=true;
+		lc.decoded++;
+		pthread_cond_signal(&lc.ready);
+		pthread_mutex_unlock(&lc.lock);
+	}
+	return NULL;
+}
+
+bool liveCaptureOpen(LiveCapture &lc, const char* source)
+{
+	if(isLiveSource(source) && strstr(source,"://")==NULL)
+		lc.cap.open(atoi(source));
+	else
+		lc.cap.open(source);
+	if(!lc.cap.isOpened())
+		return false;
+	
+	double fps=lc.cap.get(CV_CAP_PROP_FPS);
+	if(fps>1.0 && fps<1000.0)
+		framePeriod=1000.0/fps;
+	
+	pthread_mutex_init(&lc.lock,NULL);
+	pthread_cond_init(&lc.ready,NULL);
+	lc.newestStamp=0.0;
+	lc.fresh=false;
+	lc.running=true;
+	lc.decoded=0;
+	lc.dropped=0;
+	if(pthread_create(&lc.thread,NULL,liveCaptureLoop,&lc)!=0)
+	{
+		lc.running=false;
+		return false;
+	}
+	return true;
+}
+
+// blocks until a frame newer than the last one read is available
+bool liveCaptureRead(LiveCapture &lc, Mat &frame, double &stamp)
+{
+	pthread_mutex_lock(&lc.lock);
+	while(!lc.fresh && lc.running)
+		pthread_cond_wait(&lc.ready,&lc.lock);
+	if(!lc.fresh)
+	{
+		pthread_mutex_unlock(&lc.lock);
+		frame.release();
+		return false;
+	}
+	frame=lc.newest;
+	lc.newest.release();
+	stamp=lc.newestStamp;
+	lc.fresh=false;
+	pthread_mutex_unlock(&lc.lock);
+	return true;
+}
+
+void liveCaptureClose(LiveCapture &lc)
+{
+	pthread_mutex_lock(&lc.lock);
+	lc.running=false;
+	pthread_mutex_unlock(&lc.lock);
+	pthread_join(lc.thread,NULL);
+	lc.cap.release();
+	pthread_mutex_destroy(&lc.lock);
+	pthread_cond_destroy(&lc.ready);
+	cout << "Live capture: " << lc.decoded << " decoded, " << lc.dropped << " dropped" << endl;
+}
+
+
+
+//--------lut-gradient--------------------
+
+// without gamma correction dx and dy of 8 bit images are integers in [-255,255],
+// so the binned gradient of every (dx,dy) pair is computed once, with the same
+// cartToPolar call and binning arithmetic as HOGDescriptor::computeGradient
+#define LUT_RANGE 511
+struct GradientLUT
+{
+	int nbins;
+	vector<float> w0, w1;			// mag*(1-alpha), mag*alpha
+	vector<unsigned short> bins;	// lower bin | upper bin<<8 (qangle pair)
+};
+static GradientLUT gradLut;
+
+static inline int lutIndex(int dx, int dy)
+{
+	return (dy+255)*LUT_RANGE + dx+255;
+}
+
+void buildGradientLUT(int nbins)
+{
+	if(gradLut.nbins==nbins && !gradLut.w0.empty())
+		return;
+	gradLut.w0.resize(LUT_RANGE*LUT_RANGE);
+	gradLut.w1.resize(LUT_RANGE*LUT_RANGE);
+	gradLut.bins.resize(LUT_RANGE*LUT_RANGE+1); // +1: the gather reads 4 bytes
+	
+	Mat Dx(1, LUT_RANGE, CV_32F), Dy(1, LUT_RANGE, CV_32F), Mag, Angle;
+	float angleScale = (float)(nbins/CV_PI);
+	for(int dy=-255; dy<=255; dy++)
+	{
+		for(int dx=-255; dx<=255; dx++)
+		{
+			Dx.at<float>(0,dx+255)=(float)dx;
+			Dy.at<float>(0,dx+255)=(float)dy;
+		}
+		cartToPolar(Dx, Dy, Mag, Angle, false);
+		for(int dx=-255; dx<=255; dx++)
+		{
+			int k=lutIndex(dx,dy);
+			float mag = Mag.at<float>(0,dx+255), angle = Angle.at<float>(0,dx+255)*angleScale - 0.5f;
+			int hidx = cvFloor(angle);
+			angle -= hidx;
+			gradLut.w0[k] = mag*(1.f - angle);
+			gradLut.w1[k] = mag*angle;
+			if( hidx < 0 )
+				hidx += nbins;
+			else if( hidx >= nbins )
+				hidx -= nbins;
+			int hidx2 = hidx+1;
+			hidx2 &= hidx2 < nbins ? -1 : 0;
+			gradLut.bins[k] = (unsigned short)(hidx | (hidx2<<8));
+		}
+	}
+	gradLut.bins[LUT_RANGE*LUT_RANGE]=0;
+	gradLut.nbins=nbins; // last: computeGradient uses the table once this matches
+}
+
+static void gradientLookup(const int* idx, int n, float* grad, uchar* qangle)
+{
+	const float* w0=&gradLut.w0[0];
+	const float* w1=&gradLut.w1[0];
+	const unsigned short* bins=&gradLut.bins[0];
+	for(int x=0; x<n; x++)
+	{
+		int k=idx[x];
+		grad[x*2]=w0[k];
+		grad[x*2+1]=w1[k];
+		qangle[x*2]=(uchar)(bins[k]&255);
+		qangle[x*2+1]=(uchar)(bins[k]>>8);
+	}
+}
+
+// 8 lookups per step with hardware gathers, the tables are too large for shuffles
+__attribute__((target("avx2")))
+static void gradientLookupAVX2(const int* idx, int n, float* grad, uchar* qangle)
+{
+	const float* w0=&gradLut.w0[0];
+	const float* w1=&gradLut.w1[0];
+	const int* bins=(const int*)&gradLut.bins[0];
+	const __m256i lowHalf=_mm256_set1_epi32(0xffff);
+	int x=0;
+	for(; x<=n-8; x+=8)
+	{
+		__m256i k=_mm256_loadu_si256((const __m256i*)(idx+x));
+		__m256 a=_mm256_i32gather_ps(w0,k,4);
+		__m256 b=_mm256_i32gather_ps(w1,k,4);
+		__m256 lo=_mm256_unpacklo_ps(a,b);		// a0 b0 a1 b1 | a4 b4 a5 b5
+		__m256 hi=_mm256_unpackhi_ps(a,b);		// a2 b2 a3 b3 | a6 b6 a7 b7
+		_mm256_storeu_ps(grad+x*2,_mm256_permute2f128_ps(lo,hi,0x20));
+		_mm256_storeu_ps(grad+x*2+8,_mm256_permute2f128_ps(lo,hi,0x31));
+		
+		__m256i q=_mm256_and_si256(_mm256_i32gather_epi32(bins,k,2),lowHalf);
+		_mm_storeu_si128((__m128i*)(qangle+x*2),
+						 _mm_packus_epi32(_mm256_castsi256_si128(q),_mm256_extracti128_si256(q,1)));
+	}
+	gradientLookup(idx+x, n-x, grad+x*2, qangle+x*2);
+}
+
+// drop-in for HOGDescriptor::computeGradient: same border handling and channel
+// selection, the atan2/sqrt/binning work is replaced by one table lookup per pixel
+void LutHOGDescriptor::computeGradient(const Mat& img, Mat& grad, Mat& qangle,
+									   Size paddingTL, Size paddingBR) const
+{
+	int cn = img.channels();
+	if( gammaCorrection || img.depth() != CV_8U || (cn != 1 && cn != 3) || nbins > 255 ||
+		gradLut.nbins != nbins ) // table of another descriptor
+	{
+		HOGDescriptor::computeGradient(img, grad, qangle, paddingTL, paddingBR);
+		return;
+	}
+	static const bool avx2=__builtin_cpu_supports("avx2");
+	
+	Size gradsize(img.cols + paddingTL.width + paddingBR.width,
+				  img.rows + paddingTL.height + paddingBR.height);
+	grad.create(gradsize, CV_32FC2);  // <magnitude*(1-alpha), magnitude*alpha>
+	qangle.create(gradsize, CV_8UC2); // [0..nbins-1] - quantized gradient orientation
+	Size wholeSize;
+	Point roiofs;
+	img.locateROI(wholeSize, roiofs);
+	
+	int x, y;
+	vector<int> mapbuf(gradsize.width + gradsize.height + 4);
+	int* xmap = &mapbuf[0] + 1;
+	int* ymap = xmap + gradsize.width + 2;
+	const int borderType = (int)BORDER_REFLECT_101;
+	for( x = -1; x < gradsize.width + 1; x++ )
+		xmap[x] = borderInterpolate(x - paddingTL.width + roiofs.x,
+									wholeSize.width, borderType) - roiofs.x;
+	for( y = -1; y < gradsize.height + 1; y++ )
+		ymap[y] = borderInterpolate(y - paddingTL.height + roiofs.y,
+									wholeSize.height, borderType) - roiofs.y;
+	
+	int width = gradsize.width;
+	vector<int> idx(width);
+	for( y = 0; y < gradsize.height; y++ )
+	{
+		const uchar* imgPtr  = img.data + img.step*ymap[y];
+		const uchar* prevPtr = img.data + img.step*ymap[y-1];
+		const uchar* nextPtr = img.data + img.step*ymap[y+1];
+		
+		if( cn == 1 )
+		{
+			for( x = 0; x < width; x++ )
+			{
+				int x1 = xmap[x];
+				idx[x] = lutIndex(imgPtr[xmap[x+1]] - imgPtr[xmap[x-1]], nextPtr[x1] - prevPtr[x1]);
+			}
+		}
+		else
+		{
+			// strongest channel wins, checked in the reference order R, G, B
+			for( x = 0; x < width; x++ )
+			{
+				int x1 = xmap[x]*3;
+				const uchar* p2 = imgPtr + xmap[x+1]*3;
+				const uchar* p0 = imgPtr + xmap[x-1]*3;
+				int dx0 = p2[2] - p0[2], dy0 = nextPtr[x1+2] - prevPtr[x1+2];
+				int mag0 = dx0*dx0 + dy0*dy0;
+				for( int c = 1; c >= 0; c-- )
+				{
+					int dx = p2[c] - p0[c], dy = nextPtr[x1+c] - prevPtr[x1+c];
+					int mag = dx*dx + dy*dy;
+					if( mag0 < mag )
+					{
+						dx0 = dx;
+						dy0 = dy;
+						mag0 = mag;
+					}
+				}
+				idx[x] = lutIndex(dx0, dy0);
+			}
+		}
+		
+		if( avx2 )
+			gradientLookupAVX2(&idx[0], width, grad.ptr<float>(y), qangle.ptr(y));
+		else
+			gradientLookup(&idx[0], width, grad.ptr<float>(y), qangle.ptr(y));
+	}
+}
+
+// runs the reference computeGradient and the lut kernel on img and counts the
+// gradient/bin entries that are not bit identical
+int verifyLutGradient(const LutHOGDescriptor &hog, const Mat &img)
+{
+	Mat g0, q0, g1, q1;
+	hog.HOGDescriptor::computeGradient(img, g0, q0, Size(8,8), Size(8,8));
+	hog.computeGradient(img, g1, q1, Size(8,8), Size(8,8));
+	int mismatches=0;
+	for(int y=0; y<g0.rows; y++)
+	{
+		const unsigned int* a=g0.ptr<unsigned int>(y);
+		const unsigned int* b=g1.ptr<unsigned int>(y);
+		const uchar* qa=q0.ptr(y);
+		const uchar* qb=q1.ptr(y);
+		for(int x=0; x<g0.cols*2; x++)
+			if(a[x]!=b[x] || qa[x]!=qb[x])
+				mismatches++;
+	}
+	return mismatches;
+}
+
+
+
+//--------integral-hog--------------------
+
+// Integral orientation histograms over img: one running sum per bin of the
+// interpolated gradient votes (computeGradient of the given hog, so --lut applies).
+// A cell histogram of any rectangle is then 4 reads per bin.
+//
+// Accuracy trade-off against the pyramid detector: the window is not resampled,
+// so gradients are taken at the source resolution; block histograms have no
+// gaussian weighting and cells no bilinear spatial interpolation. Scores follow
+// the trained model closely but not exactly, sparseHitThreshold absorbs the bias.
+void buildIntegralHOG(const HOGDescriptor &hog, const Mat &img, IntegralHOG &ih)
+{
+	Mat grad, qangle;
+	hog.computeGradient(img, grad, qangle);
+	int nbins=hog.nbins;
+	ih.nbins=nbins;
+	ih.cols=img.cols;
+	ih.rows=img.rows;
+	int stride=(img.cols+1)*nbins;
+	ih.sum.assign((size_t)(img.rows+1)*stride, 0.f);
+	
+	vector<float> rowSum(nbins);
+	for(int y=0; y<img.rows; y++)
+	{
+		const float* g=grad.ptr<float>(y);
+		const uchar* q=qangle.ptr(y);
+		const float* above=&ih.sum[(size_t)y*stride];
+		float* cur=&ih.sum[(size_t)(y+1)*stride];
+		std::fill(rowSum.begin(), rowSum.end(), 0.f);
+		for(int x=0; x<img.cols; x++)
+		{
+			rowSum[q[x*2]]+=g[x*2];
+			rowSum[q[x*2+1]]+=g[x*2+1];
+			float* out=cur+(x+1)*nbins;
+			const float* up=above+(x+1)*nbins;
+			for(int b=0; b<nbins; b++)
+				out[b]=up[b]+rowSum[b];
+		}
+	}
+}
+
+static void cellHistogram(const IntegralHOG &ih, int x0, int y0, int x1, int y1, float scale, float* hist)
+{
+	int stride=(ih.cols+1)*ih.nbins;
+	const float* a=&ih.sum[(size_t)y0*stride + x0*ih.nbins];
+	const float* b=&ih.sum[(size_t)y0*stride + x1*ih.nbins];
+	const float* c=&ih.sum[(size_t)y1*stride + x0*ih.nbins];
+	const float* d=&ih.sum[(size_t)y1*stride + x1*ih.nbins];
+	for(int k=0; k<ih.nbins; k++)
+		hist[k]=(d[k]-b[k]-c[k]+a[k])*scale;
+}
+
+// same as the L2Hys block normalization of the hog
+static void normalizeBlock(float* hist, int sz, float thresh)
+{
+	float sum=0;
+	for(int i=0; i<sz; i++)
+		sum+=hist[i]*hist[i];
+	float scale=1.f/(std::sqrt(sum)+sz*0.1f);
+	sum=0;
+	for(int i=0; i<sz; i++)
+	{
+		hist[i]=std::min(hist[i]*scale, thresh);
+		sum+=hist[i]*hist[i];
+	}
+	scale=1.f/(std::sqrt(sum)+1e-3f);
+	for(int i=0; i<sz; i++)
+		hist[i]*=scale;
+}
+
+// svm score of an arbitrary window (in integral image coordinates): the hog grid
+// is stretched over the window, blocks and cells in descriptor order (column major)
+float scoreIntegralHOG(const HOGDescriptor &hog, const IntegralHOG &ih, Rect window, const vector<float> &svm)
+{
+	window &= Rect(0, 0, ih.cols, ih.rows);
+	if(window.width<=0 || window.height<=0)
+		return -1e9f;
+	double sx=(double)window.width/hog.winSize.width, sy=(double)window.height/hog.winSize.height;
+	float areaScale=(float)(1.0/(sx*sy)); // cell sums as if taken at the model resolution
+	int nbx=(hog.winSize.width-hog.blockSize.width)/hog.blockStride.width+1;
+	int nby=(hog.winSize.height-hog.blockSize.height)/hog.blockStride.height+1;
+	int ncx=hog.blockSize.width/hog.cellSize.width, ncy=hog.blockSize.height/hog.cellSize.height;
+	int blockHistSize=ncx*ncy*ih.nbins;
+	
+	vector<float> block(blockHistSize);
+	const float* w=&svm[0];
+	float s=0.f;
+	for(int bx=0; bx<nbx; bx++)
+		for(int by=0; by<nby; by++)
+		{
+			for(int cx=0; cx<ncx; cx++)
+				for(int cy=0; cy<ncy; cy++)
+				{
+					int px=bx*hog.blockStride.width+cx*hog.cellSize.width;
+					int py=by*hog.blockStride.height+cy*hog.cellSize.height;
+					int x0=window.x+cvRound(px*sx), x1=window.x+cvRound((px+hog.cellSize.width)*sx);
+					int y0=window.y+cvRound(py*sy), y1=window.y+cvRound((py+hog.cellSize.height)*sy);
+					cellHistogram(ih, x0, y0, x1, y1, areaScale, &block[(cx*ncy+cy)*ih.nbins]);
+				}
+			normalizeBlock(&block[0], blockHistSize, (float)hog.L2HysThreshold);
+			for(int k=0; k<blockHistSize; k++)
+				s+=block[k]*w[k];
+			w+=blockHistSize;
+		}
+	if(svm.size()>(size_t)(w-&svm[0]))
+		s+=*w; // offset
+	return s;
+}
+
+// scores windows of the tracked object size, centred on a subset of the particles
+// (plus/minus one pyramid step in scale), instead of scanning a pyramid of the roi.
+// The best window above sparseHitThreshold is returned in roi coordinates.
+bool sparseDetect(const HOGDescriptor &hog, const vector<float> &svm, const Mat &img, Point roiOfs,
+				  Size objSize, vector<Rect> &found)
+{
+	if(svm.size()<hog.getDescriptorSize())
+		return false;
+	IntegralHOG ih;
+	buildIntegralHOG(hog, img, ih);
+	
+	const int maxHyps=100;
+	const double scales[3]={1.0/1.05, 1.0, 1.05};
+	int step=MAX(1, particleCount()/maxHyps);
+	float best=-1e9f;
+	Rect bestRect;
+	for(int i=0; i<particleCount(); i+=step)
+	{
+		Point2f p=particlePosition(i);
+		int cx=(int)p.x-roiOfs.x;
+		int cy=(int)p.y-roiOfs.y;
+		if(cx<0 || cy<0 || cx>=img.cols || cy>=img.rows)
+			continue;
+		for(int k=0; k<3; k++)
+		{
+			Size sz(cvRound(objSize.width*scales[k]), cvRound(objSize.height*scales[k]));
+			Rect r(cx-sz.width/2, cy-sz.height/2, sz.width, sz.height);
+			if(r.x<0 || r.y<0 || r.x+r.width>img.cols || r.y+r.height>img.rows)
+				continue;
+			float score=scoreIntegralHOG(hog, ih, r, svm);
+			if(score>best)
+			{
+				best=score;
+				bestRect=r;
+			}
+		}
+	}
+	if(best<sparseHitThreshold)
+		return false;
+	found.push_back(bestRect);
+	return true;
+}
+
+
+
+//--------hog-detection--------------------
+
+// image handed to the hog: a copy of src, or its luminance when grayDetection is set.
+// src may be a roi view, the conversion reads it in place so the roi is copied only once
+void hogInput(const Mat &src, Mat &dst)
+{
+	if(grayDetection)
+		bgrToGray(src, dst);
+	else
+		dst=src.clone();
+}
+
+// same fixed point weights as cvtColor(CV_BGR2GRAY), so models trained either way match
+enum { GRAY_SHIFT=14, GRAY_B=1868, GRAY_G=9617, GRAY_R=4899 };
+
+__attribute__((target("ssse3")))
+static void bgrToGrayRowSSSE3(const uchar* src, uchar* dst, int n)
+{
+	// pshufb masks splitting 16 interleaved pixels (3 registers) into B, G and R planes
+	const __m128i b0=_mm_setr_epi8(0,3,6,9,12,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+	const __m128i b1=_mm_setr_epi8(-1,-1,-1,-1,-1,-1,2,5,8,11,14,-1,-1,-1,-1,-1);
+	const __m128i b2=_mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,1,4,7,10,13);
+	const __m128i g0=_mm_setr_epi8(1,4,7,10,13,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+	const __m128i g1=_mm_setr_epi8(-1,-1,-1,-1,-1,0,3,6,9,12,15,-1,-1,-1,-1,-1);
+	const __m128i g2=_mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,2,5,8,11,14);
+	const __m128i r0=_mm_setr_epi8(2,5,8,11,14,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+	const __m128i r1=_mm_setr_epi8(-1,-1,-1,-1,-1,1,4,7,10,13,-1,-1,-1,-1,-1,-1);
+	const __m128i r2=_mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,0,3,6,9,12,15);
+	const __m128i wbg=_mm_setr_epi16(GRAY_B,GRAY_G,GRAY_B,GRAY_G,GRAY_B,GRAY_G,GRAY_B,GRAY_G);
+	const __m128i wr1=_mm_setr_epi16(GRAY_R,1<<(GRAY_SHIFT-1),GRAY_R,1<<(GRAY_SHIFT-1),GRAY_R,1<<(GRAY_SHIFT-1),GRAY_R,1<<(GRAY_SHIFT-1));
+	const __m128i one=_mm_set1_epi16(1);
+	const __m128i zero=_mm_setzero_si128();
+	int x=0;
+	for(; x<=n-16; x+=16)
+	{
+		__m128i p0=_mm_loadu_si128((const __m128i*)(src+x*3));
+		__m128i p1=_mm_loadu_si128((const __m128i*)(src+x*3+16));
+		__m128i p2=_mm_loadu_si128((const __m128i*)(src+x*3+32));
+		__m128i b=_mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0,b0),_mm_shuffle_epi8(p1,b1)),_mm_shuffle_epi8(p2,b2));
+		__m128i g=_mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0,g0),_mm_shuffle_epi8(p1,g1)),_mm_shuffle_epi8(p2,g2));
+		__m128i r=_mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0,r0),_mm_shuffle_epi8(p1,r1)),_mm_shuffle_epi8(p2,r2));
+		
+		__m128i y16[2];
+		for(int h=0; h<2; h++)
+		{
+			__m128i b16=h ? _mm_unpackhi_epi8(b,zero) : _mm_unpacklo_epi8(b,zero);
+			__m128i g16=h ? _mm_unpackhi_epi8(g,zero) : _mm_unpacklo_epi8(g,zero);
+			__m128i r16=h ? _mm_unpackhi_epi8(r,zero) : _mm_unpacklo_epi8(r,zero);
+			// (b,g) and (r,1) pairs: one madd gives b*wb+g*wg, the other r*wr+rounding
+			__m128i lo=_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(b16,g16),wbg),
+									 _mm_madd_epi16(_mm_unpacklo_epi16(r16,one),wr1));
+			__m128i hi=_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(b16,g16),wbg),
+									 _mm_madd_epi16(_mm_unpackhi_epi16(r16,one),wr1));
+			y16[h]=_mm_packs_epi32(_mm_srli_epi32(lo,GRAY_SHIFT),_mm_srli_epi32(hi,GRAY_SHIFT));
+		}
+		_mm_storeu_si128((__m128i*)(dst+x),_mm_packus_epi16(y16[0],y16[1]));
+	}
+	for(; x<n; x++)
+		dst[x]=(uchar)((src[x*3]*GRAY_B + src[x*3+1]*GRAY_G + src[x*3+2]*GRAY_R + (1<<(GRAY_SHIFT-1))) >> GRAY_SHIFT);
+}
+
+static void bgrToGrayRow(const uchar* src, uchar* dst, int n)
+{
+	for(int x=0; x<n; x++)
+		dst[x]=(uchar)((src[x*3]*GRAY_B + src[x*3+1]*GRAY_G + src[x*3+2]*GRAY_R + (1<<(GRAY_SHIFT-1))) >> GRAY_SHIFT);
+}
+
+// BGR to luminance in a single pass over src (a roi view is fine, no clone needed)
+void bgrToGray(const Mat &src, Mat &dst)
+{
+	if(src.channels()==1)
+	{
+		dst=src.clone();
+		return;
+	}
+	static const bool ssse3=__builtin_cpu_supports("ssse3");
+	Mat gray(src.rows, src.cols, CV_8UC1); // src and dst may be the same Mat
+	for(int y=0; y<src.rows; y++)
+	{
+		if(ssse3)
+			bgrToGrayRowSSSE3(src.ptr(y), gray.ptr(y), src.cols);
+		else
+			bgrToGrayRow(src.ptr(y), gray.ptr(y), src.cols);
+	}
+	dst=gray;
+}
+
+void hogDetect(Mat &img, HOGDescriptor &hog)
+{
+	vector<Rect> found, found_filtered;
+	double t = (double)getTickCount();
+	// run the detector with default parameters. to get a higher hit-rate
+	// (and more false alarms, respectively), decrease the hitThreshold and
+	// groupThreshold (set groupThreshold to 0 to turn off the grouping completely).
+	hog.detectMultiScale(img, found, 0, Size(8,8), Size(32,32), 1.05, 2);
+	t = (double)getTickCount() - t;
+	printf("HOG detection time = %gms\n", t*1000./cv::getTickFrequency());
+	size_t i, j;
+	for( i = 0; i < found.size(); i++ )
+	{
+		Rect r = found[i];
+		for( j = 0; j < found.size(); j++ )
+			if( j != i && (r & found[j]) == r)
+				break;
+		if( j == found.size() )
+			found_filtered.push_back(r);
+	}
+	for( i = 0; i < found_filtered.size(); i++ )
+	{
+		Rect r = found_filtered[i];
+		// the HOG detector returns slightly larger rectangles than the real objects.
+		// so we slightly shrink the rectangles to get a nicer output.
+		r.x += cvRound(r.width*0.1);
+		r.width = cvRound(r.width*0.8);
+		r.y += cvRound(r.height*0.07);
+		r.height = cvRound(r.height*0.8);
+		rectangle(img, r.tl(), r.br(), cv::Scalar(255,0,0), 1);
+	}
+	
+}
+
+// Two pass scan: detectMultiScale at stride 16 with a relaxed threshold and no
+// grouping, then stride 8 at the level of every near-positive window, only inside
+// that window grown by one coarse stride. Sparse scenes evaluate about 1/4 of the
+// windows of a full stride 8 scan. Returns the number of windows evaluated.
+int coarseToFineDetect(const HOGDescriptor &hog, const Mat &img, vector<Rect> &found)
+{
+	const Size coarseStride(16,16), fineStride(8,8), padding(32,32);
+	const double scale0=1.05;
+	vector<Rect> coarse;
+	vector<double> weights;
+	hog.detectMultiScale(img, coarse, weights, -coarseRelaxation, coarseStride, padding, scale0, 0);
+	
+	// windows of the coarse pass: every level of the pyramid, padded image
+	int evaluated=0;
+	for(double s=1.0; cvRound(img.cols/s)>=hog.winSize.width && cvRound(img.rows/s)>=hog.winSize.height; s*=scale0)
+		evaluated+=((cvRound(img.cols/s)+2*padding.width-hog.winSize.width)/coarseStride.width+1)*
+				   ((cvRound(img.rows/s)+2*padding.height-hog.winSize.height)/coarseStride.height+1);
+	
+	vector<Rect> refined, done;
+	for(size_t i=0; i<coarse.size(); i++)
+	{
+		Rect r=coarse[i];
+		double s=(double)r.width/hog.winSize.width;
+		Point c(r.x+r.width/2, r.y+r.height/2);
+		
+		// neighbour of a window already refined at the same level
+		bool covered=false;
+		for(size_t j=0; j<done.size() && !covered; j++)
+			covered= done[j].width==r.width &&
+					 abs(done[j].x+done[j].width/2-c.x) < cvRound(fineStride.width*s) &&
+					 abs(done[j].y+done[j].height/2-c.y) < cvRound(fineStride.height*s);
+		if(covered)
+			continue;
+		done.push_back(r);
+		
+		// the window grown by a coarse stride on each side, taken at the window level
+		int mx=cvRound(coarseStride.width*s), my=cvRound(coarseStride.height*s);
+		Rect nb(r.x-mx, r.y-my, r.width+2*mx, r.height+2*my);
+		Rect inside=nb & Rect(0, 0, img.cols, img.rows);
+		if(inside.width<=0 || inside.height<=0)
+			continue;
+		Mat patch;
+		copyMakeBorder(img(inside), patch, inside.y-nb.y, nb.y+nb.height-inside.y-inside.height,
+					   inside.x-nb.x, nb.x+nb.width-inside.x-inside.width, BORDER_REFLECT_101);
+		Mat level;
+		resize(patch, level, Size(cvRound(nb.width/s), cvRound(nb.height/s)));
+		if(level.cols<hog.winSize.width || level.rows<hog.winSize.height)
+			continue;
+		
+		vector<Point> hits;
+		vector<double> hitWeights;
+		hog.detect(level, hits, hitWeights, 0, fineStride, Size(0,0));
+		evaluated+=((level.cols-hog.winSize.width)/fineStride.width+1)*
+				   ((level.rows-hog.winSize.height)/fineStride.height+1);
+		for(size_t k=0; k<hits.size(); k++)
+			refined.push_back(Rect(nb.x+cvRound(hits[k].x*s), nb.y+cvRound(hits[k].y*s), r.width, r.height));
+	}
+	groupRectangles(refined, 2, 0.2);
+	found.insert(found.end(), refined.begin(), refined.end());
+	return evaluated;
+}
+
+void detectAddSelection(Mat img, ObjectDetector &detector)
+{
+	vector<Rect> found, found_filtered;
+	double t = (double)getTickCount();
+	detector.detect(img, Point(), Size(), found);
+	t = (double)getTickCount() - t;
+	printf("%s detection time = %gms\n", detector.name(), t*1000./cv::getTickFrequency());
+	size_t i, j;
+	for( i = 0; i < found.size(); i++ )
+	{
+		Rect r = found[i];
+		for( j = 0; j < found.size(); j++ )
+			if( j != i && (r & found[j]) == r)
 				break;
 		if( j == found.size() )
 			found_filtered.push_back(r);
 	}
-	for( i = 0; i < found_filtered.size(); i++ )
+	for( i = 0; i < found_filtered.size(); i++ )
+	{
+		Rect r = found_filtered[i];
+		selection=r;
+		selectObject=false;
+		// the HOG detector returns slightly larger rectangles than the real objects.
+		// so we slightly shrink the rectangles to get a nicer output.
+		//		r.x += cvRound(r.width*0.1);
+		//		r.width = cvRound(r.width*0.8);
+		//		r.y += cvRound(r.height*0.07);
+		//		r.height = cvRound(r.height*0.8);
+		//		rectangle(img, r.tl(), r.br(), cv::Scalar(0,255,0), 1);
+	}
+	
+}
+
+
+
+//--------detection-cache--------------------
+// FNV-1a style hash, 8 bytes at a time, over whole rows (all columns and
+// channels) at a stride of FINGERPRINT_ROW_STRIDE plus the last row. Any object
+// taller than the stride moving anywhere in the roi changes sampled pixels;
+// meant for byte identical repeats, not for near duplicates
+#define FINGERPRINT_ROW_STRIDE 8
+static unsigned long long fingerprintRow(unsigned long long h, const uchar* p, size_t rowBytes)
+{
+	size_t k=0;
+	for(; k+8<=rowBytes; k+=8)
+	{
+		unsigned long long v;
+		memcpy(&v, p+k, 8);
+		h^=v;
+		h*=1099511628211ULL;
+	}
+	for(; k<rowBytes; k++)
+	{
+		h^=p[k];
+		h*=1099511628211ULL;
+	}
+	return h;
+}
+
+unsigned long long frameFingerprint(const Mat &img)
+{
+	unsigned long long h=14695981039346656037ULL;
+	size_t rowBytes=(size_t)img.cols*img.elemSize();
+	for(int y=0; y<img.rows; y+=FINGERPRINT_ROW_STRIDE)
+		h=fingerprintRow(h, img.ptr<uchar>(y), rowBytes);
+	// the last row closes the gap at the bottom
+	if(img.rows>0 && (img.rows-1)%FINGERPRINT_ROW_STRIDE!=0)
+		h=fingerprintRow(h, img.ptr<uchar>(img.rows-1), rowBytes);
+	return h;
+}
+
+bool detectionCacheLookup(DetectionCache &dc, const DetectionCacheEntry &key, vector<Rect> &found)
+{
+	for(size_t i=dc.entries.size(); i-->0; )
+	{
+		const DetectionCacheEntry &e=dc.entries[i];
+		if(e.fingerprint==key.fingerprint && e.roi==key.roi && e.modeRois==key.modeRois && e.objSize==key.objSize &&
+		   e.modelVersion==key.modelVersion && e.gray==key.gray)
+		{
+			found.insert(found.end(), e.found.begin(), e.found.end());
+			dc.hits++;
+			return true;
+		}
+	}
+	dc.misses++;
+	return false;
+}
+
+void detectionCacheStore(DetectionCache &dc, const DetectionCacheEntry &key, const vector<Rect> &found)
+{
+	if(dc.entries.size()>=dc.capacity)
+		dc.entries.erase(dc.entries.begin());
+	dc.entries.push_back(key);
+	dc.entries.back().found=found;
+}
+
+
+
+//--------hog-svm-detector--------------------
+
+HogSvmDetector::HogSvmDetector(Size win)
+: hog(win, Size(16,16), Size(8,8), Size(8,8),9,1,-1,0,0.2,!lutGradient)
+{
+}
+
+// also compiles the model for the level buffer scorer, so every load path
+// (model file, default detector, retraining) ends up with both layouts
+void HogSvmDetector::setModel(const vector<float> &m)
+{
+	model=m;
+	hog.setSVMDetector(model);
+	compileSVMModel(hog, model, compiled);
+	modelVersion++;
+}
+
+void HogSvmDetector::detect(const Mat &img, Point roiOfs, Size objSize, vector<Rect> &found)
+{
+	Mat input;
+	hogInput(img, input);
+	if(!shapes.empty())
+	{
+		// all shapes in one pass, the block histograms of each level are shared
+		vector<const CompiledSVM*> models(1, &compiled);
+		vector<Size> sizes(1, hog.winSize);
+		for(size_t k=0; k<shapes.size(); k++)
+		{
+			models.push_back(&shapes[k].compiled);
+			sizes.push_back(shapes[k].winSize);
+		}
+		vector<int> shapeOf;
+		multiShapeDetectMultiScale(hog, models, sizes, input, found, shapeOf);
+	}
+	else if(sparseScoring && objSize.width>0)
+		sparseDetect(hog, model, input, roiOfs, objSize, found);
+	else if(coarseToFine)
+		cout << "Windows evaluated: " << coarseToFineDetect(hog, input, found) << endl;
+	else if(compiledScoring)
+		compiledDetectMultiScale(hog, compiled, input, found);
+	else
+		hog.detectMultiScale(input, found, 0, Size(8,8), Size(32,32), 1.05, 2);
+}
+
+
+
+//--------compiled-model--------------------
+
+// all block histograms of img in one hog compute call: a descriptor whose window
+// is the whole image (rounded down to the block grid) is exactly the level buffer
+void computeLevelBlocks(const HOGDescriptor &hog, const Mat &img, HogLevelBlocks &lb)
+{
+	lb.nbx=(img.cols-hog.blockSize.width)/hog.blockStride.width+1;
+	lb.nby=(img.rows-hog.blockSize.height)/hog.blockStride.height+1;
+	lb.histSize=(hog.blockSize.width/hog.cellSize.width)*(hog.blockSize.height/hog.cellSize.height)*hog.nbins;
+	lb.data.clear();
+	lb.blocks=NULL;
+	if(lb.nbx<=0 || lb.nby<=0)
+		return;
+	size_t need=(size_t)lb.nbx*lb.nby*lb.histSize+16;
+	if(hugePages && need>lb.data.capacity())
+	{
+		// new storage advised before the compute first touches it. The scan
+		// keeps lb and starts with the largest level, so this happens once
+		hugeTransparentBytes-=lb.advised;
+		vector<float>().swap(lb.data);
+		lb.data.reserve(need);
+		lb.data.push_back(0.f);
+		lb.advised=adviseHugePages(&lb.data[0], need*sizeof(float), true);
+		hugeTransparentBytes+=lb.advised;
+		lb.data.clear();
+	}
+	Size levelWin((lb.nbx-1)*hog.blockStride.width+hog.blockSize.width,
+				  (lb.nby-1)*hog.blockStride.height+hog.blockSize.height);
+	LutHOGDescriptor level(levelWin, hog.blockSize, hog.blockStride, hog.cellSize, hog.nbins,
+						   hog.derivAperture, hog.winSigma, hog.histogramNormType,
+						   hog.L2HysThreshold, hog.gammaCorrection);
+	level.compute(img(Rect(0, 0, levelWin.width, levelWin.height)), lb.data, hog.blockStride, Size(0,0));
+	lb.data.resize(lb.data.size()+16, 0.f); // the last column stream may read past the end
+	lb.blocks=&lb.data[0];
+}
+
+// keeps the weights aligned: the copied storage may start at a different alignment
+CompiledSVM& CompiledSVM::operator=(const CompiledSVM &o)
+{
+	scorer=o.scorer;
+	specialized=o.specialized;
+	wnbx=o.wnbx;
+	wnby=o.wnby;
+	histSize=o.histSize;
+	colLen=o.colLen;
+	bias=o.bias;
+	storage=o.storage;
+	alignOfs=0;
+	if(storage.empty())
+		return *this;
+	alignOfs=(32-((size_t)&storage[0]&31))/sizeof(float)%8;
+	if(alignOfs!=o.alignOfs)
+		memmove(&storage[alignOfs], &storage[o.alignOfs], (size_t)wnbx*colLen*sizeof(float));
+	return *this;
+}
+
+// model index of block (bx,by) of the window is (bx*wnby+by)*histSize; its compiled
+// position is bx*colLen+by*histSize, the same offset it has in the level buffer
+// relative to the window's top block of that column
+void compileSVMModel(const HOGDescriptor &hog, const vector<float> &model, CompiledSVM &cm)
+{
+	cm.wnbx=(hog.winSize.width-hog.blockSize.width)/hog.blockStride.width+1;
+	cm.wnby=(hog.winSize.height-hog.blockSize.height)/hog.blockStride.height+1;
+	cm.histSize=(hog.blockSize.width/hog.cellSize.width)*(hog.blockSize.height/hog.cellSize.height)*hog.nbins;
+	cm.colLen=(cm.wnby*cm.histSize+15)&~15;
+	int descSize=cm.wnbx*cm.wnby*cm.histSize;
+	cm.bias= (int)model.size()>descSize ? model[descSize] : 0.f;
+	cm.scorer=selectWindowScorer(cm.wnbx, cm.wnby, cm.histSize, hog.nbins);
+	cm.specialized= cm.scorer!=scoreCompiled;
+	
+	cm.storage.assign(cm.wnbx*cm.colLen+8, 0.f);
+	cm.alignOfs=(32-((size_t)&cm.storage[0]&31))/sizeof(float)%8;
+	if((int)model.size()<descSize)
+		return;
+	float* w=&cm.storage[cm.alignOfs];
+	for(int bx=0; bx<cm.wnbx; bx++)
+		for(int by=0; by<cm.wnby; by++)
+			memcpy(w+bx*cm.colLen+by*cm.histSize, &model[(bx*cm.wnby+by)*cm.histSize],
+				   cm.histSize*sizeof(float));
+}
+
+// window with top left block (bx,by): wnbx aligned streams of colLen floats
+float scoreCompiled(const CompiledSVM &cm, const HogLevelBlocks &lb, int bx, int by)
+{
+	const float* w=cm.weights();
+	__m128 acc0=_mm_setzero_ps(), acc1=_mm_setzero_ps(), acc2=_mm_setzero_ps(), acc3=_mm_setzero_ps();
+	for(int x=0; x<cm.wnbx; x++, w+=cm.colLen)
 	{
-		Rect r = found_filtered[i];
-		// the HOG detector returns slightly larger rectangles than the real objects.
-		// so we slightly shrink the rectangles to get a nicer output.
-		r.x += cvRound(r.width*0.1);
-		r.width = cvRound(r.width*0.8);
-		r.y += cvRound(r.height*0.07);
-		r.height = cvRound(r.height*0.8);
-		rectangle(img, r.tl(), r.br(), cv::Scalar(255,0,0), 1);
+		const float* src=lb.blocks+((size_t)(bx+x)*lb.nby+by)*lb.histSize;
+		for(int k=0; k<cm.colLen; k+=16)
+		{
+			acc0=_mm_add_ps(acc0,_mm_mul_ps(_mm_loadu_ps(src+k),   _mm_load_ps(w+k)));
+			acc1=_mm_add_ps(acc1,_mm_mul_ps(_mm_loadu_ps(src+k+4), _mm_load_ps(w+k+4)));
+			acc2=_mm_add_ps(acc2,_mm_mul_ps(_mm_loadu_ps(src+k+8), _mm_load_ps(w+k+8)));
+			acc3=_mm_add_ps(acc3,_mm_mul_ps(_mm_loadu_ps(src+k+12),_mm_load_ps(w+k+12)));
+		}
+	}
+	float s[4];
+	_mm_storeu_ps(s,_mm_add_ps(_mm_add_ps(acc0,acc1),_mm_add_ps(acc2,acc3)));
+	return s[0]+s[1]+s[2]+s[3]+cm.bias;
+}
+
+// the window geometries we run most, with block, cell and bin counts fixed at compile
+// time: the column streams have constant length and are fully unrolled
+template<int N> struct StreamDot
+{
+	static inline void run(const float* src, const float* w, __m128 &a0, __m128 &a1, __m128 &a2, __m128 &a3)
+	{
+		a0=_mm_add_ps(a0,_mm_mul_ps(_mm_loadu_ps(src),   _mm_load_ps(w)));
+		a1=_mm_add_ps(a1,_mm_mul_ps(_mm_loadu_ps(src+4), _mm_load_ps(w+4)));
+		a2=_mm_add_ps(a2,_mm_mul_ps(_mm_loadu_ps(src+8), _mm_load_ps(w+8)));
+		a3=_mm_add_ps(a3,_mm_mul_ps(_mm_loadu_ps(src+12),_mm_load_ps(w+12)));
+		StreamDot<N-1>::run(src+16, w+16, a0, a1, a2, a3);
+	}
+};
+template<> struct StreamDot<0>
+{
+	static inline void run(const float*, const float*, __m128&, __m128&, __m128&, __m128&) {}
+};
+
+template<int WNBX, int WNBY, int CELLS, int NBINS>
+static float scoreCompiledFixed(const CompiledSVM &cm, const HogLevelBlocks &lb, int bx, int by)
+{
+	enum { HIST=CELLS*NBINS, COLLEN=(WNBY*HIST+15)&~15 };
+	const float* w=cm.weights();
+	const size_t colStride=(size_t)lb.nby*HIST;
+	const float* src=lb.blocks+((size_t)bx*lb.nby+by)*HIST;
+	__m128 acc0=_mm_setzero_ps(), acc1=_mm_setzero_ps(), acc2=_mm_setzero_ps(), acc3=_mm_setzero_ps();
+	for(int x=0; x<WNBX; x++)
+		StreamDot<COLLEN/16>::run(src+x*colStride, w+x*COLLEN, acc0, acc1, acc2, acc3);
+	float s[4];
+	_mm_storeu_ps(s,_mm_add_ps(_mm_add_ps(acc0,acc1),_mm_add_ps(acc2,acc3)));
+	return s[0]+s[1]+s[2]+s[3]+cm.bias;
+}
+
+// 16x16 blocks of 2x2 cells, 8 pixel stride, 9 bins: 64x128 people, 48x96, 64x64
+// square objects. Other geometries use the generic scoreCompiled
+WindowScorer selectWindowScorer(int wnbx, int wnby, int histSize, int nbins)
+{
+	if(nbins==9 && histSize==4*9)
+	{
+		if(wnbx==7 && wnby==15)
+			return scoreCompiledFixed<7,15,4,9>;
+		if(wnbx==5 && wnby==11)
+			return scoreCompiledFixed<5,11,4,9>;
+		if(wnbx==7 && wnby==7)
+			return scoreCompiledFixed<7,7,4,9>;
+	}
+	return scoreCompiled;
+}
+
+// reference: the flat model in descriptor order, block by block
+float scoreFlat(const HOGDescriptor &hog, const vector<float> &model, const HogLevelBlocks &lb, int bx, int by)
+{
+	int wnbx=(hog.winSize.width-hog.blockSize.width)/hog.blockStride.width+1;
+	int wnby=(hog.winSize.height-hog.blockSize.height)/hog.blockStride.height+1;
+	const float* w=&model[0];
+	float s=0.f;
+	for(int x=0; x<wnbx; x++)
+		for(int y=0; y<wnby; y++)
+		{
+			const float* src=lb.blocks+((size_t)(bx+x)*lb.nby+by+y)*lb.histSize;
+			for(int k=0; k<lb.histSize; k++)
+				s+=src[k]*w[k];
+			w+=lb.histSize;
+		}
+	if(model.size()>(size_t)(w-&model[0]))
+		s+=*w;
+	return s;
+}
+
+// detectMultiScale over level buffers: same 1.05 pyramid and block stride as the
+// default scan, but windows must lie inside the image (no 32 pixel padding).
+// Every model (window shape) is scored on the same block buffer of a level, so
+// extra shapes cost only their window scoring. shapeOf gets the model of each rect
+void multiShapeDetectMultiScale(const HOGDescriptor &hog, const vector<const CompiledSVM*> &models,
+								const vector<Size> &sizes, const Mat &img, vector<Rect> &found, vector<int> &shapeOf)
+{
+	vector< vector<Rect> > hits(models.size());
+	Size minWin=sizes[0];
+	for(size_t m=1; m<sizes.size(); m++)
+		minWin=Size(MIN(minWin.width, sizes[m].width), MIN(minWin.height, sizes[m].height));
+	static HogLevelBlocks lb; // kept across frames: long lived, huge pages with --hugepages
+	for(double s=1.0; ; s*=1.05)
+	{
+		Size levelSize(cvRound(img.cols/s), cvRound(img.rows/s));
+		if(levelSize.width<minWin.width || levelSize.height<minWin.height)
+			break;
+		Mat level;
+		framePooled(level);
+		if(s==1.0)
+			level=img;
+		else
+			resize(img, level, levelSize);
+		computeLevelBlocks(hog, level, lb);
+		for(size_t m=0; m<models.size(); m++)
+		{
+			const CompiledSVM &cm=*models[m];
+			for(int bx=0; bx+cm.wnbx<=lb.nbx; bx++)
+				for(int by=0; by+cm.wnby<=lb.nby; by++)
+					if(cm.scorer(cm, lb, bx, by)>0)
+						hits[m].push_back(Rect(cvRound(bx*hog.blockStride.width*s), cvRound(by*hog.blockStride.height*s),
+											   cvRound(sizes[m].width*s), cvRound(sizes[m].height*s)));
+		}
+	}
+	for(size_t m=0; m<models.size(); m++)
+	{
+		groupRectangles(hits[m], 2, 0.2);
+		found.insert(found.end(), hits[m].begin(), hits[m].end());
+		shapeOf.insert(shapeOf.end(), hits[m].size(), (int)m);
+	}
+}
+
+void compiledDetectMultiScale(const HOGDescriptor &hog, const CompiledSVM &cm, const Mat &img, vector<Rect> &found)
+{
+	vector<int> shapeOf;
+	multiShapeDetectMultiScale(hog, vector<const CompiledSVM*>(1, &cm), vector<Size>(1, hog.winSize),
+							   img, found, shapeOf);
+}
+
+// scoring throughput on one level buffer of img: flat model vs compiled model, with
+// the opencv detect (gradients and histograms included) for reference
+void benchmarkModelScoring(HogSvmDetector &hd, const Mat &img, FILE* out)
+{
+	Mat input;
+	hogInput(img, input);
+	HogLevelBlocks lb;
+	computeLevelBlocks(hd.hog, input, lb);
+	const CompiledSVM &cm=hd.compiled;
+	int nwx=lb.nbx-cm.wnbx+1, nwy=lb.nby-cm.wnby+1;
+	if(nwx<=0 || nwy<=0 || hd.model.size()<hd.hog.getDescriptorSize())
+		return;
+	const int repeats=10;
+	double windows=(double)nwx*nwy*repeats;
+	
+	volatile float sink=0.f;
+	float maxDiff=0.f;
+	double t0=(double)getTickCount();
+	for(int r=0; r<repeats; r++)
+		for(int bx=0; bx<nwx; bx++)
+			for(int by=0; by<nwy; by++)
+				sink+=scoreFlat(hd.hog, hd.model, lb, bx, by);
+	double tFlat=((double)getTickCount()-t0)/getTickFrequency();
+	
+	t0=(double)getTickCount();
+	for(int r=0; r<repeats; r++)
+		for(int bx=0; bx<nwx; bx++)
+			for(int by=0; by<nwy; by++)
+				sink+=scoreCompiled(cm, lb, bx, by);
+	double tCompiled=((double)getTickCount()-t0)/getTickFrequency();
+	
+	t0=(double)getTickCount();
+	for(int r=0; r<repeats; r++)
+		for(int bx=0; bx<nwx; bx++)
+			for(int by=0; by<nwy; by++)
+				sink+=cm.scorer(cm, lb, bx, by);
+	double tSpecialized=((double)getTickCount()-t0)/getTickFrequency();
+	
+	for(int bx=0; bx<nwx; bx++)
+		for(int by=0; by<nwy; by++)
+		{
+			float ref=scoreFlat(hd.hog, hd.model, lb, bx, by);
+			maxDiff=MAX(maxDiff, fabs(ref-scoreCompiled(cm, lb, bx, by)));
+			maxDiff=MAX(maxDiff, fabs(ref-cm.scorer(cm, lb, bx, by)));
+		}
+	
+	// the compiled scan once more on 4 KiB pages (a copy advised against huge
+	// pages before it is written) and on huge pages: the level buffer itself
+	// with --hugepages, as the scan uses it, otherwise a copy in hugeAlloc memory
+	size_t bytes=lb.data.size()*sizeof(float);
+	vector<float> small;
+	small.reserve(lb.data.size());
+	small.push_back(0.f);
+	adviseHugePages(&small[0], bytes, false);
+	small.assign(lb.data.begin(), lb.data.end());
+	HugeBuffer huge;
+	if(!lb.advised)
+	{
+		huge.reserve(bytes);
+		memcpy(huge.p, &lb.data[0], bytes);
+	}
+	long long tlb[2]={-1, -1};
+	int tlbFd=dtlbCounterOpen();
+	for(int pass=0; pass<2; pass++)
+	{
+		lb.blocks=pass==0 ? &small[0] : lb.advised ? &lb.data[0] : (const float*)huge.p;
+		dtlbCounterRead(tlbFd);
+		for(int r=0; r<repeats; r++)
+			for(int bx=0; bx<nwx; bx++)
+				for(int by=0; by<nwy; by++)
+					sink+=scoreCompiled(cm, lb, bx, by);
+		tlb[pass]=dtlbCounterRead(tlbFd);
 	}
+	lb.blocks=&lb.data[0];
+	if(tlbFd>=0)
+		close(tlbFd);
+	
+	vector<Point> pts;
+	t0=(double)getTickCount();
+	hd.hog.detect(input, pts, 0, hd.hog.blockStride, Size(0,0));
+	double tDetect=((double)getTickCount()-t0)/getTickFrequency();
 	
+	printf("Scoring %d windows: flat %.0f win/s, compiled %.0f win/s (x%.2f), %s %.0f win/s (x%.2f), max diff %g, opencv detect %.0f win/s\n",
+		   nwx*nwy, windows/tFlat, windows/tCompiled, tFlat/tCompiled,
+		   cm.specialized ? "specialized" : "generic", windows/tSpecialized, tFlat/tSpecialized,
+		   maxDiff, nwx*nwy/tDetect);
+	if(tlb[0]>=0)
+		printf("dTLB read misses per 1000 windows: %.2f on 4 KiB pages, %.2f on huge pages (%s)\n",
+			   tlb[0]*1000.0/windows, tlb[1]*1000.0/windows, lb.advised ? "level buffer, madvise" : "hugeAlloc copy");
+	if(out!=NULL)
+		fprintf(out, "%d,%d,%f,%f,%f,%f,%lld,%lld\n", frameNumber, nwx*nwy, windows/tFlat, windows/tCompiled,
+				windows/tSpecialized, nwx*nwy/tDetect, tlb[0], tlb[1]);
 }
 
-void hogDetectAddSelection(Mat img, HOGDescriptor &hog)
+// the shape must fit the block grid of the main window (16x16 blocks, 8 pixel stride)
+bool HogSvmDetector::addShape(Size win, const char* modelFile)
 {
-	vector<Rect> found, found_filtered;
-	double t = (double)getTickCount();
-	// run the detector with default parameters. to get a higher hit-rate
-	// (and more false alarms, respectively), decrease the hitThreshold and
-	// groupThreshold (set groupThreshold to 0 to turn off the grouping completely).
-	hog.detectMultiScale(img, found, 0, Size(8,8), Size(32,32), 1.05, 2);
-	t = (double)getTickCount() - t;
-	printf("HOG detection time = %gms\n", t*1000./cv::getTickFrequency());
-	size_t i, j;
-	for( i = 0; i < found.size(); i++ )
+	if(win.width<hog.blockSize.width || win.height<hog.blockSize.height ||
+	   (win.width-hog.blockSize.width)%hog.blockStride.width!=0 ||
+	   (win.height-hog.blockSize.height)%hog.blockStride.height!=0)
+		return false;
+	FILE* f=fopen(modelFile, "r");
+	if(f==NULL)
+		return false;
+	fclose(f);
+	
+	HogShape shape;
+	shape.winSize=win;
+	loadSVMfromFile(modelFile, &shape.model);
+	LutHOGDescriptor shapeHog(win, hog.blockSize, hog.blockStride, hog.cellSize, hog.nbins,
+							  hog.derivAperture, hog.winSigma, hog.histogramNormType,
+							  hog.L2HysThreshold, hog.gammaCorrection);
+	if(shape.model.size()<shapeHog.getDescriptorSize())
+		return false;
+	compileSVMModel(shapeHog, shape.model, shape.compiled);
+	shapes.push_back(shape);
+	modelVersion++;
+	return true;
+}
+
+void HogSvmDetector::retrain()
+{
+	hogTraining();
+	vector<float> m;
+	loadSVMfromFile("modelweight", &m);
+	setModel(m);
+}
+
+
+
+//--------acf-detector--------------------
+// Aggregate channel features (Dollar et al.): LUV, normalized gradient magnitude and
+// 6 orientation channels summed over shrink x shrink blocks, classified by boosted
+// depth two trees with a soft cascade. Intermediate pyramid scales are approximated
+// from the nearest computed octave instead of recomputing the channels.
+
+#define ACF_CHANNELS 10
+#define ACF_ORIENTATIONS 6
+
+// channels of bgr stacked vertically in one CV_32F buffer (ACF_CHANNELS blocks of
+// rows/shrink x cols/shrink)
+static void acfChannels(const Mat &bgr, int shrink, Mat &chans)
+{
+	int h=bgr.rows/shrink, w=bgr.cols/shrink;
+	Mat img=bgr(Rect(0, 0, w*shrink, h*shrink));
+	Mat color, luv, luvf;
+	if(img.channels()==1)
+		cvtColor(img, color, CV_GRAY2BGR);
+	else
+		color=img;
+	cvtColor(color, luv, CV_BGR2Luv);
+	luv.convertTo(luvf, CV_32F, 1./255.);
+	vector<Mat> full;
+	split(luvf, full);
+	
+	// gradient of L, magnitude normalized by its local average
+	Mat dx, dy, mag, angle, smooth;
+	Sobel(full[0], dx, CV_32F, 1, 0, 1);
+	Sobel(full[0], dy, CV_32F, 0, 1, 1);
+	cartToPolar(dx, dy, mag, angle, false);
+	blur(mag, smooth, Size(11,11));
+	mag=mag/(smooth+0.005);
+	full.push_back(mag);
+	
+	for(int o=0; o<ACF_ORIENTATIONS; o++)
+		full.push_back(Mat::zeros(mag.size(), CV_32F));
+	const float binScale=(float)(ACF_ORIENTATIONS/CV_PI);
+	for(int y=0; y<mag.rows; y++)
 	{
-		Rect r = found[i];
-		for( j = 0; j < found.size(); j++ )
-			if( j != i && (r & found[j]) == r)
-				break;
-		if( j == found.size() )
-			found_filtered.push_back(r);
+		const float* m=mag.ptr<float>(y);
+		const float* a=angle.ptr<float>(y);
+		for(int x=0; x<mag.cols; x++)
+		{
+			int o=(int)(a[x]*binScale)%ACF_ORIENTATIONS; // unsigned orientation
+			full[4+o].at<float>(y,x)=m[x];
+		}
 	}
-	for( i = 0; i < found_filtered.size(); i++ )
+	
+	chans.create(ACF_CHANNELS*h, w, CV_32F);
+	for(int c=0; c<ACF_CHANNELS; c++)
 	{
-		Rect r = found_filtered[i];
-		selection=r;
-		selectObject=false;
-		// the HOG detector returns slightly larger rectangles than the real objects.
-		// so we slightly shrink the rectangles to get a nicer output.
-		//		r.x += cvRound(r.width*0.1);
-		//		r.width = cvRound(r.width*0.8);
-		//		r.y += cvRound(r.height*0.07);
-		//		r.height = cvRound(r.height*0.8);
-		//		rectangle(img, r.tl(), r.br(), cv::Scalar(0,255,0), 1);
+		Mat block=chans(Rect(0, c*h, w, h));
+		resize(full[c], block, Size(w,h), 0, 0, INTER_AREA);
+		GaussianBlur(block, block, Size(3,3), 0);
+	}
+}
+
+// channels of a level scale/realScale smaller than the computed one: resampled, and
+// the gradient channels corrected with the power law of the acf paper (lambda=0.1105)
+static void acfApproximate(const Mat &real, double ratio, Size levelSize, int shrink, Mat &chans)
+{
+	int rh=real.rows/ACF_CHANNELS;
+	int h=levelSize.height/shrink, w=levelSize.width/shrink;
+	chans.create(ACF_CHANNELS*h, w, CV_32F);
+	double gain=pow(ratio, 0.1105);
+	for(int c=0; c<ACF_CHANNELS; c++)
+	{
+		Mat block=chans(Rect(0, c*h, w, h));
+		resize(real(Rect(0, c*rh, real.cols, rh)), block, Size(w,h), 0, 0, INTER_AREA);
+		if(c>=3)
+			block*=gain;
+	}
+}
+
+AcfDetector::AcfDetector(Size win)
+: winSize(win), shrink(4), nWeak(128), cascadeThreshold(-1.f), hitThreshold(0.f)
+{
+}
+
+bool AcfDetector::load(const char* filename)
+{
+	FILE* in=fopen(filename, "r");
+	if(in==NULL)
+		return false;
+	int n=0;
+	if(fscanf(in, "acf %d %d %d %d\n", &winSize.width, &winSize.height, &shrink, &n)!=4)
+	{
+		fclose(in);
+		return false;
+	}
+	trees.resize(n);
+	for(int i=0; i<n; i++)
+	{
+		AcfTree &t=trees[i];
+		fscanf(in, "%d %f %d %f %d %f %f %f %f %f\n", &t.fid[0], &t.thr[0], &t.fid[1], &t.thr[1],
+			   &t.fid[2], &t.thr[2], &t.leaf[0], &t.leaf[1], &t.leaf[2], &t.leaf[3]);
+	}
+	fclose(in);
+	modelVersion++;
+	return true;
+}
+
+bool AcfDetector::save(const char* filename) const
+{
+	FILE* out=fopen(filename, "w");
+	if(out==NULL)
+		return false;
+	fprintf(out, "acf %d %d %d %d\n", winSize.width, winSize.height, shrink, (int)trees.size());
+	for(size_t i=0; i<trees.size(); i++)
+	{
+		const AcfTree &t=trees[i];
+		fprintf(out, "%d %g %d %g %d %g %g %g %g %g\n", t.fid[0], t.thr[0], t.fid[1], t.thr[1],
+				t.fid[2], t.thr[2], t.leaf[0], t.leaf[1], t.leaf[2], t.leaf[3]);
+	}
+	fclose(out);
+	return true;
+}
+
+// every window of the level at a stride of one aggregation block
+void AcfDetector::scanLevel(const Mat &chans, double scale, vector<Rect> &found) const
+{
+	int rows=chans.rows/ACF_CHANNELS, cols=chans.cols;
+	int ww=winSize.width/shrink, wh=winSize.height/shrink;
+	if(rows<wh || cols<ww)
+		return;
+	// feature id (channel, y, x in the window) -> offset from the window origin
+	vector<int> offset(ACF_CHANNELS*ww*wh);
+	for(int c=0; c<ACF_CHANNELS; c++)
+		for(int y=0; y<wh; y++)
+			for(int x=0; x<ww; x++)
+				offset[(c*wh+y)*ww+x]=(c*rows+y)*(int)(chans.step/sizeof(float))+x;
+	
+	const float* data=chans.ptr<float>(0);
+	int step=(int)(chans.step/sizeof(float));
+	for(int y=0; y<=rows-wh; y++)
+		for(int x=0; x<=cols-ww; x++)
+		{
+			const float* base=data+y*step+x;
+			float score=0.f;
+			size_t t;
+			for(t=0; t<trees.size(); t++)
+			{
+				const AcfTree &tr=trees[t];
+				int node=base[offset[tr.fid[0]]]<tr.thr[0] ? 1 : 2;
+				int leaf=(node-1)*2 + (base[offset[tr.fid[node]]]<tr.thr[node] ? 0 : 1);
+				score+=tr.leaf[leaf];
+				if(score<cascadeThreshold)
+					break;
+			}
+			if(t==trees.size() && score>hitThreshold)
+				found.push_back(Rect(cvRound(x*shrink*scale), cvRound(y*shrink*scale),
+									 cvRound(winSize.width*scale), cvRound(winSize.height*scale)));
+		}
+}
+
+void AcfDetector::detect(const Mat &img, Point roiOfs, Size objSize, vector<Rect> &found)
+{
+	if(trees.empty())
+		return;
+	const int scalesPerOctave=8;
+	vector<Rect> hits;
+	Mat real, chans;
+	double realScale=1.0;
+	for(int i=0; ; i++)
+	{
+		double s=pow(2.0, (double)i/scalesPerOctave);
+		Size levelSize(cvRound(img.cols/s), cvRound(img.rows/s));
+		if(levelSize.width<winSize.width || levelSize.height<winSize.height)
+			break;
+		if(i%scalesPerOctave==0)
+		{
+			Mat level;
+			framePooled(level);
+			if(i==0)
+				level=img;
+			else
+				resize(img, level, levelSize, 0, 0, INTER_AREA);
+			acfChannels(level, shrink, real);
+			realScale=s;
+			scanLevel(real, s, hits);
+		}
+		else
+		{
+			acfApproximate(real, s/realScale, levelSize, shrink, chans);
+			scanLevel(chans, s, hits);
+		}
+	}
+	groupRectangles(hits, 2, 0.2);
+	found.insert(found.end(), hits.begin(), hits.end());
+}
+
+// channel features of one window-size sample, appended to X
+static void acfSample(const Mat &win, int shrink, vector<float> &X)
+{
+	Mat chans;
+	acfChannels(win, shrink, chans);
+	for(int y=0; y<chans.rows; y++)
+		X.insert(X.end(), chans.ptr<float>(y), chans.ptr<float>(y)+chans.cols);
+}
+
+// best split of the samples in idx over a random subset of features: the quantized
+// threshold minimizing the weighted error of majority-vote leaves
+static void acfBestSplit(const vector<uchar> &Q, int n, int nf, const vector<int> &idx,
+						 const vector<int> &ys, const vector<double> &w, const vector<int> &feats,
+						 int &bestF, int &bestBin)
+{
+	double bestErr=1e30;
+	bestF=feats[0];
+	bestBin=0;
+	double hp[256], hn[256];
+	for(size_t k=0; k<feats.size(); k++)
+	{
+		int f=feats[k];
+		const uchar* q=&Q[(size_t)f*n];
+		memset(hp, 0, sizeof(hp));
+		memset(hn, 0, sizeof(hn));
+		double wp=0, wn=0;
+		for(size_t j=0; j<idx.size(); j++)
+		{
+			int i=idx[j];
+			if(ys[i]>0) { hp[q[i]]+=w[i]; wp+=w[i]; }
+			else		{ hn[q[i]]+=w[i]; wn+=w[i]; }
+		}
+		double cp=0, cn=0;
+		for(int b=0; b<255; b++)
+		{
+			cp+=hp[b];
+			cn+=hn[b];
+			double err=MIN(cp,cn)+MIN(wp-cp,wn-cn);
+			if(err<bestErr)
+			{
+				bestErr=err;
+				bestF=f;
+				bestBin=b;
+			}
+		}
+	}
+}
+
+static float acfLeaf(double wp, double wn)
+{
+	double v=0.5*log((wp+1e-10)/(wn+1e-10));
+	return (float)MAX(-4.0, MIN(4.0, v));
+}
+
+// real adaboost over depth two trees, the same positives and negatives hogTraining
+// reads (centered crops of pos.lst, 10 random windows of each neg.lst image)
+void AcfDetector::retrain()
+{
+	vector<float> X;
+	vector<int> ys;
+	char name[512];
+	
+	sprintf(name,"%s/pos.lst", Trainpath);
+	FILE *poss=fopen(name,"r");
+	while (poss != NULL && !feof(poss))
+	{
+		char filename[512], temp[50];
+		if (fscanf(poss,"%s\n",temp) != 1)
+			break;
+		sprintf(filename,"%s/%s",Trainpath, temp);
+		Mat image = imread(filename);
+		if (image.data == NULL || image.cols < winSize.width || image.rows < winSize.height)
+			continue;
+		Mat win = image(Rect(image.cols/2 - winSize.width/2, image.rows/2 - winSize.height/2,
+							 winSize.width, winSize.height)), flipped;
+		flip(win, flipped, 1);
+		acfSample(win, shrink, X);
+		ys.push_back(1);
+		acfSample(flipped, shrink, X);
+		ys.push_back(1);
+	}
+	if (poss != NULL)
+		fclose(poss);
+	
+	sprintf(name,"%s/neg.lst", Trainpath);
+	FILE *negs=fopen(name,"r");
+	RNG rng((unsigned)time(NULL));
+	while (negs != NULL && !feof(negs))
+	{
+		char filename[512], temp[50];
+		if (fscanf(negs,"%s\n",temp) != 1)
+			break;
+		sprintf(filename,"%s/%s",Trainpath, temp);
+		Mat image = imread(filename);
+		if (image.data == NULL || image.rows < winSize.height || image.cols < winSize.width)
+			continue;
+		for (int j = 0; j < 10; j++)
+		{
+			Size sc;
+			sc.height = rng.uniform(winSize.height, image.rows+1);
+			sc.width = cvRound((double)sc.height/winSize.height*winSize.width);
+			if (sc.width > image.cols)
+			{
+				sc.width = image.cols;
+				sc.height = cvRound((double)sc.width/winSize.width*winSize.height);
+			}
+			Point pt(rng.uniform(0, image.cols-sc.width+1), rng.uniform(0, image.rows-sc.height+1));
+			Mat win;
+			resize(image(Rect(pt, sc)), win, winSize, 0, 0, INTER_AREA);
+			acfSample(win, shrink, X);
+			ys.push_back(-1);
+		}
+	}
+	if (negs != NULL)
+		fclose(negs);
+	
+	int n=(int)ys.size();
+	int npos=(int)std::count(ys.begin(), ys.end(), 1), nneg=n-npos;
+	if (npos==0 || nneg==0)
+	{
+		cout << "acf: need positives and negatives to train" << endl;
+		return;
+	}
+	int nf=(int)(X.size()/n);
+	cout << "acf: " << npos << " positives, " << nneg << " negatives, " << nf << " features" << endl;
+	
+	// features quantized to 256 bins, stored feature major for the split search
+	vector<float> fmin(nf), fstep(nf);
+	vector<uchar> Q((size_t)nf*n);
+	for (int f = 0; f < nf; f++)
+	{
+		float lo=X[f], hi=X[f];
+		for (int i = 1; i < n; i++)
+		{
+			lo=MIN(lo, X[(size_t)i*nf+f]);
+			hi=MAX(hi, X[(size_t)i*nf+f]);
+		}
+		fmin[f]=lo;
+		fstep[f]=MAX((hi-lo)/256.f, 1e-6f);
+		for (int i = 0; i < n; i++)
+			Q[(size_t)f*n+i]=(uchar)MIN(255, (int)((X[(size_t)i*nf+f]-lo)/fstep[f]));
 	}
 	
+	vector<double> w(n);
+	for (int i = 0; i < n; i++)
+		w[i]= ys[i]>0 ? 0.5/npos : 0.5/nneg;
+	vector<double> h(n, 0.0);
+	vector<int> all(n);
+	for (int i = 0; i < n; i++)
+		all[i]=i;
+	
+	// a quarter of the features per tree keeps online retraining short
+	int nsub=MAX(1, nf/4);
+	vector<int> feats(nsub);
+	trees.clear();
+	for (int t = 0; t < nWeak; t++)
+	{
+		for (int k = 0; k < nsub; k++)
+			feats[k]=rng.uniform(0, nf);
+		
+		AcfTree tree;
+		int bin[3];
+		acfBestSplit(Q, n, nf, all, ys, w, feats, tree.fid[0], bin[0]);
+		vector<int> side[2];
+		for (int i = 0; i < n; i++)
+			side[Q[(size_t)tree.fid[0]*n+i]<=bin[0] ? 0 : 1].push_back(i);
+		for (int c = 0; c < 2; c++)
+		{
+			if (side[c].empty())
+			{
+				tree.fid[c+1]=tree.fid[0];
+				bin[c+1]=255;
+			}
+			else
+				acfBestSplit(Q, n, nf, side[c], ys, w, feats, tree.fid[c+1], bin[c+1]);
+		}
+		
+		// leaves, then reweighting
+		double wp[4]={0,0,0,0}, wn[4]={0,0,0,0};
+		vector<int> leafOf(n);
+		for (int c = 0; c < 2; c++)
+			for (size_t j = 0; j < side[c].size(); j++)
+			{
+				int i=side[c][j];
+				int l=c*2 + (Q[(size_t)tree.fid[c+1]*n+i]<=bin[c+1] ? 0 : 1);
+				leafOf[i]=l;
+				if (ys[i]>0) wp[l]+=w[i]; else wn[l]+=w[i];
+			}
+		for (int l = 0; l < 4; l++)
+			tree.leaf[l]=acfLeaf(wp[l], wn[l]);
+		for (int k = 0; k < 3; k++)
+			tree.thr[k]=fmin[tree.fid[k]]+(bin[k]+1)*fstep[tree.fid[k]];
+		
+		double sum=0;
+		int errors=0;
+		for (int i = 0; i < n; i++)
+		{
+			h[i]+=tree.leaf[leafOf[i]];
+			w[i]*=exp(-ys[i]*tree.leaf[leafOf[i]]);
+			sum+=w[i];
+			if (h[i]*ys[i]<=0)
+				errors++;
+		}
+		for (int i = 0; i < n; i++)
+			w[i]/=sum;
+		trees.push_back(tree);
+		
+		if (t%16==15)
+		{
+			cout << "acf: " << t+1 << " trees, training error " << (double)errors/n << endl;
+			flush(cout);
+		}
+	}
+	save("model.acf");
+	modelVersion++;
 }
 
 
@@ -917,6 +5259,13 @@ void onMouse( int event, int x, int y, int, void* )
     }
 }
 
+// the last model trained in each input mode, besides modelweight (the model of
+// the last training, whatever its mode)
+const char* modeModelFile(bool gray)
+{
+	return gray ? "modelweight.gray" : "modelweight.color";
+}
+
 int hogTraining() {
 	
 	setlocale (LC_NUMERIC, "en_GB");
@@ -924,7 +5273,7 @@ int hogTraining() {
 	bool b_TS = true;		//write training set
 	bool b_TeS = false;		//write test set
 	bool b_cvtModel = true;	//convert model file to weight vector file
-	bool b_evalTest = false;	//reiterate through negative images of training set and append false positives to training set
+	bool b_evalTest = evalTrainset;	//reiterate through negative images of training set and append false positives to training set
 	bool b_learn = true;	//use SVMlight to learn
 	
 	if (b_TS){
@@ -944,6 +5293,7 @@ int hogTraining() {
 		vector<float> test;
 		loadSVMfromModelFile("model", &test);
 		saveSVMtoFile("modelweight", test);
+		saveSVMtoFile(modeModelFile(grayDetection), test);
 	}
 	if (b_evalTest){
 		cout << "Evaluating Train Set Negatives..." << endl;
@@ -965,6 +5315,7 @@ int hogTraining() {
 				vector<float> test;
 				loadSVMfromModelFile("model", &test);
 				saveSVMtoFile("modelweight", test);
+				saveSVMtoFile(modeModelFile(grayDetection), test);
 			}
 		}
 		
@@ -1092,7 +5443,7 @@ void buildSet(const char* outfile, const char*path){
 	if (direc == NULL)
 		return;
 	struct dirent * file;
-	HOGDescriptor* hog = new HOGDescriptor(windowsz, blockSize, cellSize, cellSize,9,1,-1,0,0.2,true);
+	HOGDescriptor* hog = new LutHOGDescriptor(windowsz, blockSize, cellSize, cellSize,9,1,-1,0,0.2,!lutGradient);
 	
 	namedWindow("Images", CV_WINDOW_AUTOSIZE);
 	cout << "Positives: ";
@@ -1126,7 +5477,8 @@ void buildSet(const char* outfile, const char*path){
 						image.rows/2 - windowsz.height/2, 
 						windowsz.width,
 						windowsz.height);
-		Mat scale =  image(roi).clone();
+		Mat scale;
+		hogInput(image(roi), scale);
 		vector<float> desc;
 		
 		//compute feature vector
@@ -1195,6 +5547,7 @@ void buildSet(const char* outfile, const char*path){
 				
 				Mat scale;
 				resize(image(roi),scale,windowsz);
+				hogInput(scale, scale);
 				imshow("Images", scale);
 				waitKey(10);
 				vector<float> desc;
@@ -1213,25 +5566,39 @@ void buildSet(const char* outfile, const char*path){
 
 
 //goes through negative images of training sets and tries to apply the detector. Each false positive is added to the training file as a hard example
+//(current mode only). Color and gray are compared as pipelines: each input mode is run with the last model trained in that mode
+//(modelweight.color / modelweight.gray, see modeModelFile), false positives on the negatives and hits on the positives
 void evaluateTrainset(){
 	
-	vector<float> classify;
+	vector<float> classify[2];	// color, gray
 	int  false_pos=0;
+	int  mode_false_pos[2]={0,0};
+	double mode_time[2]={0.0,0.0};	// ms
 	const char* trainfile = "train.dat";
 	char negpath[512];
 	FILE * output = fopen(trainfile, "a");
 	if (output == NULL)
 		return;
 	
-	loadSVMfromFile("modelweight", &classify);
-	
+	int current = grayDetection ? 1 : 0;
+	HOGDescriptor* hog[2];
+	bool evaluated[2];
+	for (int mode = 0; mode < 2; mode++){
+		hog[mode] = new LutHOGDescriptor(windowsz, blockSize, cellSize, cellSize,9,1,-1,0,0.2,!lutGradient);
+		const char* file = mode == current ? "modelweight" : modeModelFile(mode == 1);
+		if (access(file, R_OK) == 0)
+			loadSVMfromFile(file, &classify[mode]);
+		evaluated[mode] = classify[mode].size() == hog[mode]->getDescriptorSize()+1;
+		if (evaluated[mode])
+			hog[mode]->setSVMDetector(classify[mode]);
+		else
+			cout << (mode == 1 ? "Gray" : "Color") << ": no model trained in this mode (" << file << "), not evaluated" << endl;
+	}
 	
 	sprintf(negpath, "%s/neg", Trainpath);
 	DIR * direc;
 	struct dirent * file;
 	
-	HOGDescriptor* hog = new HOGDescriptor(windowsz, blockSize, cellSize, cellSize,9,1,-1,0,0.2,true);
-	hog->setSVMDetector(classify);
 	namedWindow("Images", 0);
 	
 	direc = opendir (negpath);
@@ -1252,11 +5619,30 @@ void evaluateTrainset(){
 		char filename[512];
 		sprintf(filename, "%s/%s", negpath, file->d_name);
 		Mat image = imread(filename);
-		Mat secimg = image.clone();
 		if (image.data == NULL)
 			break;
+		Mat secimg;
 		vector<Rect> found;
-		hog->detectMultiScale(secimg, found, 0, cellSize, Size(0,0), 1.1, 0);
+		for (int mode = 0; mode < 2; mode++){
+			if (!evaluated[mode])
+				continue;
+			Mat input;
+			if (mode == 1)
+				bgrToGray(image, input);
+			else
+				input = image.clone();
+			vector<Rect> modeFound;
+			double tm = (double)getTickCount();
+			hog[mode]->detectMultiScale(input, modeFound, 0, cellSize, Size(0,0), 1.1, 0);
+			mode_time[mode] += ((double)getTickCount() - tm)*1000./getTickFrequency();
+			for (int i = 0; i < modeFound.size(); i++)
+				if (!((modeFound[i].x <0)||(modeFound[i].y <0)|| (modeFound[i].x + modeFound[i].width >= image.cols) || (modeFound[i].y + modeFound[i].height >= image.rows)))
+					mode_false_pos[mode]++;
+			if (mode == current){
+				secimg = input;
+				found = modeFound;
+			}
+		}
 		
 		// training configuration for coarse training
 		// 		hog->detectMultiScale(secimg, found, 0, Size(16,16), Size(0,0), 1.1, 0);
@@ -1270,7 +5656,7 @@ void evaluateTrainset(){
 				Mat scale;
 				resize(secimg(found[i]),scale,windowsz);
 				vector<float> desc;
-				hog->compute(scale, desc,Size(8, 8),Size(0,0));
+				hog[current]->compute(scale, desc,Size(8, 8),Size(0,0));
 				scale.release();
 				writeVec(output, desc, -1);
 				desc.clear();
@@ -1287,6 +5673,44 @@ void evaluateTrainset(){
 		secimg.release();
 	}
 	cout << "Number of false positives: " << false_pos << endl;
+	
+	// hit rate on the positives of the training set
+	int hits[2]={0,0}, positives=0;
+	char name[512];
+	sprintf(name,"%s/pos.lst", Trainpath);
+	FILE *poss=fopen(name,"r");
+	while (poss != NULL && !feof(poss)){
+		char filename[512], temp[50];
+		if (fscanf(poss,"%s\n",temp) != 1)
+			break;
+		sprintf(filename,"%s/%s",Trainpath, temp);
+		Mat pos = imread(filename);
+		if (pos.data == NULL || pos.cols < windowsz.width || pos.rows < windowsz.height)
+			continue;
+		Rect roi(pos.cols/2 - windowsz.width/2, pos.rows/2 - windowsz.height/2, windowsz.width, windowsz.height);
+		positives++;
+		for (int mode = 0; mode < 2; mode++){
+			if (!evaluated[mode])
+				continue;
+			Mat input;
+			if (mode == 1)
+				bgrToGray(pos(roi), input);
+			else
+				input = pos(roi).clone();
+			vector<float> desc;
+			hog[mode]->compute(input, desc, Size(8, 8), Size(0,0));
+			if (applyClassifier(desc, classify[mode]) > 0)
+				hits[mode]++;
+		}
+	}
+	if (poss != NULL)
+		fclose(poss);
+	for (int mode = 0; mode < 2; mode++){
+		if (evaluated[mode])
+			cout << (mode == 1 ? "Gray:  " : "Color: ") << hits[mode] << " of " << positives << " positives hit, "
+				 << mode_false_pos[mode] << " false positives, " << mode_time[mode] << " ms" << endl;
+		delete hog[mode];
+	}
 	fclose(output);
 	return;
 }